@@ -304,6 +304,45 @@ alloc_from_memmap (size_t size)
 	}
 }
 
+/**
+ * Like alloc_from_memmap, but return zero instead of skipping ahead when there
+ * is no free 'size'-aligned block right below the allocation watermark.  This
+ * never gives up on the rest of a memory map entry that is usable.
+ */
+static uintptr_t
+try_alloc_from_memmap (size_t size)
+{
+	if (use_early_alloc)
+		return early_alloc_phys (size, size);
+
+	void *eptr = memmap_entry_pointer (memmap_alloc_idx);
+	while (!should_allocate (memmap_entry_type (eptr))) {
+		if (!memmap_alloc_idx)
+			return 0;
+		eptr = memmap_entry_pointer (--memmap_alloc_idx);
+	}
+
+	uintptr_t estart = memmap_entry_start (eptr);
+	uintptr_t eend = estart + memmap_entry_size (eptr);
+
+	if (memmap_alloc_wmark > eend)
+		memmap_alloc_wmark = eend;
+
+	if (memmap_alloc_wmark < min_alloc_addr + size)
+		return 0;
+
+	uintptr_t x = dsl::align_down (memmap_alloc_wmark - size, size);
+	if (x < estart)
+		return 0;
+
+	for (int i = 0; i < num_blockers; i++)
+		if (blocked (blockers[i], x, size))
+			return 0;
+
+	memmap_alloc_wmark = x;
+	return x;
+}
+
 static void
 setup_free_memory (void)
 {
@@ -471,24 +510,74 @@ tail_p1d:
 		*get_p1e (virt) = phys | flags;
 }
 
+static void
+zero_phys_page (uintptr_t phys)
+{
+	volatile unsigned char *p = (volatile unsigned char *)
+			kmap_fixed_install (KMAP_FIXED_IDX_SETUP_TMP,
+					make_pte_k (phys, PAGE_KERNEL_DATA));
+	for (uintptr_t i = 0; i < PAGE_SIZE; i++)
+		p[i] = 0;
+}
+
 static void
 setup_page_struct (uintptr_t start, uintptr_t end)
 {
+	/*
+	 * The page allocator looks at the struct Page of buddy blocks, so we
+	 * must cover entire max_page_order-sized blocks.
+	 */
+	start = dsl::align_down (start, PAGE_SIZE << max_page_order);
+	end = dsl::align_up (end, PAGE_SIZE << max_page_order);
+
 	start = dsl::align_down ((uintptr_t) phys_to_page (start), PAGE_SIZE);
 	end = dsl::align_up ((uintptr_t) phys_to_page (end), PAGE_SIZE);
 
-	for (; start != end; start += PAGE_SIZE) {
-		volatile uint64_t *entry = get_p1e (start);
+	/*
+	 * Zeroing the page_map for most of memory is deferred until all CPUs
+	 * are online; see early_free_deferred_to_pgalloc.
+	 */
+	uintptr_t defer = early_defer_page_map (start, end);
+
+	/*
+	 * Every page allocator and slab operation touches the page_map, so map
+	 * it with large pages wherever an entire P1D_SIZE-sized piece of it is
+	 * needed.  These are allocated before the small pages at the edges, so
+	 * that consecutive large allocations from the memory map do not waste
+	 * memory on alignment.  Pieces for which there is no aligned block of
+	 * free memory are left to the small pages below.
+	 */
+	for (uintptr_t x = dsl::align_up (start, P1D_SIZE);
+			x < end && end - x >= P1D_SIZE; x += P1D_SIZE) {
+		volatile uint64_t *entry = get_p2e (x);
 		if (*entry != 0)
 			continue;
 
-		uintptr_t value = alloc_from_memmap (PAGE_SIZE);
-		pte_t pte = make_pte_k (value, PAGE_KERNEL_DATA);
-		volatile unsigned char *p = (volatile unsigned char *)
-				kmap_fixed_install (KMAP_FIXED_IDX_SETUP_TMP, pte);
-		for (uintptr_t i = 0; i < PAGE_SIZE; i++)
-			p[i] = 0;
-		*entry = pte.value;
+		uintptr_t value = try_alloc_from_memmap (P1D_SIZE);
+		if (!value)
+			continue;
+
+		for (uintptr_t i = 0; i < P1D_SIZE && x + i < defer; i += PAGE_SIZE)
+			zero_phys_page (value + i);
+		*entry = value | PAGE_KERNEL_DATA | __PG_HUGE;
+	}
+
+	while (start != end) {
+		if (*get_p2e (start) & __PG_HUGE) {
+			start = dsl::min (dsl::align_down (start, P1D_SIZE) + P1D_SIZE,
+					end);
+			continue;
+		}
+
+		volatile uint64_t *entry = get_p1e (start);
+		if (*entry == 0) {
+			uintptr_t value = alloc_from_memmap (PAGE_SIZE);
+			if (start < defer)
+				zero_phys_page (value);
+			*entry = make_pte_k (value, PAGE_KERNEL_DATA).value;
+		}
+
+		start += PAGE_SIZE;
 	}
 }
 
@@ -64,6 +64,13 @@ typedef struct pte_t {
 	{
 		return !value;
 	}
+
+	/** Only meaningful for entries above the lowest level.  */
+	constexpr inline bool
+	huge (void) const
+	{
+		return (value & __PG_HUGE) ? true : false;
+	}
 } pte_t;
 
 static inline pte_t
@@ -114,6 +121,20 @@ make_io_pte (uintptr_t phys_addr, page_cache_mode pcm)
 	return make_pte_k (phys_addr, make_io_pteval (pcm));
 }
 
+/**
+ * make_huge_pte_k - make a kernel 2 MiB or 1 GiB page table entry.
+ * @phys_addr: physical address, aligned to the size of the page
+ * @flags: the flags a 4 KiB entry would have
+ */
+static inline pte_t
+make_huge_pte_k (uintptr_t phys_addr, pteval_t flags)
+{
+	if (flags & __PG_PAT)
+		flags = (flags & ~__PG_PAT) | __PG_PAT_HUGE;
+
+	return make_pte_k (phys_addr, flags | __PG_HUGE);
+}
+
 constexpr static inline int
 __pgtable_index (uintptr_t addr, int level)
 {
@@ -89,6 +89,17 @@ max_pgtable_level (void)
 	return has_feature (FEATURE_LA57) ? 5 : 4;
 }
 
+/**
+ * max_huge_level - get the highest level at which we can use huge pages.
+ *
+ * Level 1 entries map 2 MiB pages, and level 2 entries map 1 GiB pages.
+ */
+static inline int
+max_huge_level (void)
+{
+	return has_feature (FEATURE_PDPE1GB) ? 2 : 1;
+}
+
 pte_t *
 alloc_pgtable (int level);
 
@@ -15,6 +15,11 @@ this_cpu_id (void)
 void
 arch_send_smp_call_on_one_IPI (unsigned int cpu);
 
+struct cpuset;
+
+void
+arch_send_smp_call_on_many_IPI (const cpuset *cpus, unsigned int count);
+
 void
 arch_send_panic_IPI_to_others (void);
 
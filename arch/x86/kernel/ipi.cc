@@ -17,6 +17,25 @@ arch_send_smp_call_on_one_IPI (unsigned int cpu)
 	apic_send_IPI (APIC_DM_FIXED | VECTOR_SMP_CALL_ON_ONE, apicid);
 }
 
+/**
+ * arch_send_smp_call_on_many_IPI - send the SMP call IPI to a set of CPUs.
+ * @cpus: target CPUs, which must not include this CPU
+ * @count: number of CPUs in @cpus
+ */
+void
+arch_send_smp_call_on_many_IPI (const cpuset *cpus, unsigned int count)
+{
+	if (count + 1 == nr_cpus) {
+		/* @cpus contains every other CPU, so use a single broadcast.  */
+		apic_send_IPI (APIC_DST_OTHERS | APIC_DM_FIXED | VECTOR_SMP_CALL_ON_ONE, 0);
+		return;
+	}
+
+	for (unsigned int cpu : *cpus)
+		apic_send_IPI (APIC_DM_FIXED | VECTOR_SMP_CALL_ON_ONE,
+				cpu_to_apic_id (cpu));
+}
+
 void
 arch_send_panic_IPI_to_others (void)
 {
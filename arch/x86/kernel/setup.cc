@@ -13,6 +13,7 @@
 #include <davix/acpi_table.h>
 #include <davix/cpuset.h>
 #include <davix/early_alloc.h>
+#include <davix/numa.h>
 #include <davix/panic.h>
 #include <davix/printk.h>
 #include <davix/start_kernel.h>
@@ -118,6 +119,140 @@ madt_cpus (acpi_entry_hdr *entry, void *arg)
 	return UACPI_ITERATION_DECISION_CONTINUE;
 }
 
+/**
+ * SRAT and SLIT describe nodes by their proximity domain, an arbitrary 32-bit
+ * number.  We number the nodes in the order we first see them.
+ */
+static uint32_t node_to_pxm[CONFIG_MAX_NR_NODES];
+static int pxm_nr_nodes;
+
+static int
+pxm_to_node (uint32_t pxm)
+{
+	for (int node = 0; node < pxm_nr_nodes; node++)
+		if (node_to_pxm[node] == pxm)
+			return node;
+
+	if (pxm_nr_nodes == CONFIG_MAX_NR_NODES) {
+		printk (PR_WARN "numa: too many proximity domains, folding PXM %u into node 0\n",
+				pxm);
+		return 0;
+	}
+
+	node_to_pxm[pxm_nr_nodes] = pxm;
+	return pxm_nr_nodes++;
+}
+
+static int
+apic_id_to_cpu (uint32_t apic_id)
+{
+	for (unsigned int cpu : cpu_present)
+		if (cpu_to_apic_array[cpu] == apic_id)
+			return cpu;
+
+	return -1;
+}
+
+static uacpi_iteration_decision
+srat_affinity (acpi_entry_hdr *entry, void *arg)
+{
+	(void) arg;
+
+	uint32_t pxm, apic_id;
+	if (entry->type == ACPI_SRAT_ENTRY_TYPE_MEMORY_AFFINITY) {
+		acpi_srat_memory_affinity *mem =
+			(acpi_srat_memory_affinity *) entry;
+
+		if (!(mem->flags & ACPI_SRAT_MEMORY_ENABLED) || !mem->length)
+			return UACPI_ITERATION_DECISION_CONTINUE;
+
+		numa_add_memory (pxm_to_node (mem->proximity_domain),
+				mem->address, mem->address + mem->length - 1);
+		return UACPI_ITERATION_DECISION_CONTINUE;
+	} else if (entry->type == ACPI_SRAT_ENTRY_TYPE_PROCESSOR_AFFINITY) {
+		acpi_srat_processor_affinity *lapic =
+			(acpi_srat_processor_affinity *) entry;
+
+		if (!(lapic->flags & ACPI_SRAT_PROCESSOR_ENABLED))
+			return UACPI_ITERATION_DECISION_CONTINUE;
+
+		pxm = lapic->proximity_domain_low
+			| (uint32_t) lapic->proximity_domain_high[0] << 8
+			| (uint32_t) lapic->proximity_domain_high[1] << 16
+			| (uint32_t) lapic->proximity_domain_high[2] << 24;
+		apic_id = lapic->id;
+	} else if (entry->type == ACPI_SRAT_ENTRY_TYPE_X2APIC_AFFINITY) {
+		acpi_srat_x2apic_affinity *x2apic =
+			(acpi_srat_x2apic_affinity *) entry;
+
+		if (!(x2apic->flags & ACPI_SRAT_PROCESSOR_ENABLED))
+			return UACPI_ITERATION_DECISION_CONTINUE;
+
+		pxm = x2apic->proximity_domain;
+		apic_id = x2apic->id;
+	} else
+		return UACPI_ITERATION_DECISION_CONTINUE;
+
+	int cpu = apic_id_to_cpu (apic_id);
+	if (cpu != -1)
+		numa_set_cpu_node (cpu, pxm_to_node (pxm));
+
+	return UACPI_ITERATION_DECISION_CONTINUE;
+}
+
+static void
+parse_slit (void)
+{
+	uacpi_table slit_table;
+	if (uacpi_table_find_by_signature (ACPI_SLIT_SIGNATURE, &slit_table)
+			!= UACPI_STATUS_OK)
+		return;
+
+	acpi_slit *slit = (acpi_slit *) slit_table.ptr;
+	uint64_t n = slit->num_localities;
+	if (sizeof (*slit) + n * n > slit->hdr.length) {
+		printk (PR_WARN "numa: SLIT is too short, ignoring it\n");
+		uacpi_table_unref (&slit_table);
+		return;
+	}
+
+	for (int from = 0; from < pxm_nr_nodes; from++) {
+		for (int to = 0; to < pxm_nr_nodes; to++) {
+			uint32_t i = node_to_pxm[from], j = node_to_pxm[to];
+			if (i < n && j < n)
+				numa_set_distance (from, to, slit->matrix[i * n + j]);
+		}
+	}
+
+	uacpi_table_unref (&slit_table);
+}
+
+/**
+ * Discover the NUMA topology from the SRAT and SLIT.  Without an SRAT, all CPUs
+ * and all memory belong to a single node.
+ */
+static void
+numa_setup (void)
+{
+	uacpi_table srat_table;
+	if (uacpi_table_find_by_signature (ACPI_SRAT_SIGNATURE, &srat_table)
+			!= UACPI_STATUS_OK) {
+		numa_init (1);
+		return;
+	}
+
+	acpi_parse_srat ((acpi_srat *) srat_table.ptr, srat_affinity, nullptr);
+	uacpi_table_unref (&srat_table);
+
+	if (!pxm_nr_nodes) {
+		numa_init (1);
+		return;
+	}
+
+	parse_slit ();
+	numa_init (pxm_nr_nodes);
+}
+
 void
 arch_init (void)
 {
@@ -159,6 +294,8 @@ arch_init (void)
 	madt = nullptr;
 	uacpi_table_unref (&madt_table);
 
+	numa_setup ();
+
 	/**
 	 * Setup percpu variables storage for other CPUs.
 	 */
@@ -7,6 +7,7 @@
 #include <asm/gdt.h>
 #include <asm/irql.h>
 #include <asm/percpu.h>
+#include <davix/irql.h>
 #include <davix/panic.h>
 #include <davix/sched.h>
 #include <davix/task.h>
@@ -139,15 +140,65 @@ arch_ret_from_new_task (void *arg, Task *prev, void (*entry_function)(void *))
 	panic ("arch_ret_from_new_task: entry_function returned");
 }
 
+static constexpr size_t task_stack_size = 0x4000;
+
+/**
+ * Kernel stacks are allocated with kmalloc_large, which maps them with guard
+ * pages on either side.  Mapping and unmapping a stack is expensive, the latter
+ * requiring a TLB shootdown, so every CPU keeps a few freed stacks mapped for
+ * reuse by the next tasks it creates.
+ */
+static constexpr unsigned int stack_cache_size = 4;
+
+struct stack_cache {
+	unsigned int nr;
+	void *stacks[stack_cache_size];
+};
+
+static DEFINE_PERCPU(stack_cache, percpu_stack_cache);
+
+PERCPU_CONSTRUCTOR(stack_cache)
+{
+	percpu_ptr (percpu_stack_cache).on (cpu)->nr = 0;
+}
+
+static void *
+alloc_task_stack (void)
+{
+	{
+		scoped_dpc g;
+		stack_cache *sc = percpu_ptr (percpu_stack_cache);
+		if (sc->nr)
+			return sc->stacks[--sc->nr];
+	}
+
+	return kmalloc_large (task_stack_size);
+}
+
+static void
+free_task_stack (void *stack)
+{
+	{
+		scoped_dpc g;
+		stack_cache *sc = percpu_ptr (percpu_stack_cache);
+		if (sc->nr < stack_cache_size) {
+			sc->stacks[sc->nr++] = stack;
+			return;
+		}
+	}
+
+	kfree_large (stack);
+}
+
 bool
 arch_create_task (Task *task, void (*entry_function)(void *), void *arg)
 {
-	void *stack_bottom = kmalloc_large (0x4000);
+	void *stack_bottom = alloc_task_stack ();
 	if (!stack_bottom)
 		return false;
 
 	task_switch_frame *initial_frame = (task_switch_frame *)
-		((uintptr_t) stack_bottom + 0x4000 - sizeof(task_switch_frame));
+		((uintptr_t) stack_bottom + task_stack_size - sizeof(task_switch_frame));
 
 	memset (initial_frame, 0, sizeof (*initial_frame));
 	initial_frame->ip = (uintptr_t) asm_ret_from_new_task;
@@ -162,5 +213,5 @@ arch_create_task (Task *task, void (*entry_function)(void *), void *arg)
 void
 arch_free_task (Task *task)
 {
-	kfree_large (task->arch.stack_bottom);
+	free_task_stack (task->arch.stack_bottom);
 }
@@ -14,7 +14,7 @@ pte_t *
 alloc_pgtable (int level)
 {
 	(void) level;
-	Page *page = alloc_page (ALLOC_KERNEL | __ALLOC_ZERO);
+	Page *page = alloc_page (ALLOC_KERNEL | __ALLOC_ZERO | __ALLOC_HIGHPRIO);
 	return page ? (pte_t *) page_to_virt (page) : nullptr;
 }
 
@@ -64,14 +64,12 @@ tlb_end_kernel (tlb_accumulator *tlb)
 		return;
 
 	/*
-	 * TODO: this is ridiculously inefficient and doesn't scale at all.  Do
-	 * something better in the future, e.g. via some smp_call_on_every_cpu.
+	 * Kernel mappings are global, so any online CPU may have them in its
+	 * TLB.  Flush them all in parallel.
 	 */
-	for (unsigned int cpu : cpu_online)
-		smp_call_on_cpu (cpu, flush_tlb_one, tlb);
+	smp_call_on_cpus (&cpu_online, flush_tlb_one, tlb);
 
-	while (!tlb->deferred_pages.empty ())
-		free_page (tlb->deferred_pages.pop_front ());
+	free_pages_bulk (&tlb->deferred_pages);
 
 	/*
 	 * Call tlb_begin_kernel in case someone accidentally continues using
@@ -5,6 +5,7 @@
 #include <container_of.h>
 #include <string.h>
 #include <vsnprintf.h>
+#include <davix/atomic.h>
 #include <davix/fbcon.h>
 #include <davix/fbcon_internal.h>
 #include <davix/kmalloc.h>
@@ -140,14 +141,60 @@ validate_format (uint32_t width, uint32_t height, uint32_t pitch,
 	return true;
 }
 
+/**
+ * The range of rows that changed since the last flush is kept in one word, so
+ * that fbcon_flush can take it and reset it with a single atomic exchange.
+ */
+static constexpr uint64_t dirty_none = (uint64_t) uint32_t(-1) << 32;
+
+/**
+ * mark_dirty - note that rows of the backbuffer must be copied on flush.
+ * @fbcon: struct fbcon
+ * @first: first row
+ * @end: one past the last row
+ *
+ * This must be called after the rows were drawn.
+ */
+static inline void
+mark_dirty (struct fbcon *fbcon, uint32_t first, uint32_t end)
+{
+	uint64_t old = atomic_load_relaxed (&fbcon->dirty);
+	uint64_t value;
+	do {
+		uint32_t old_first = old >> 32;
+		uint32_t old_end = old;
+		if (old_first < first)
+			first = old_first;
+		if (old_end > end)
+			end = old_end;
+
+		value = (uint64_t) first << 32 | end;
+		if (value == old)
+			return;
+	} while (!atomic_cmpxchg_weak (&fbcon->dirty, &old, value,
+			mo_release, mo_relaxed));
+}
+
 /**
  * fbcon_flush - flush the output.
  * @fbcon: struct fbcon
+ *
+ * Only the rows that changed since the last flush are copied, as stores to
+ * framebuffer memory are much slower than stores to the backbuffer.
  */
 void
 fbcon_flush (struct fbcon *fbcon)
 {
-	memcpy (fbcon->fbmem, fbcon->backbuf, fbcon->nbytes);
+	uint64_t dirty = atomic_exchange_acquire (&fbcon->dirty, dirty_none);
+	uint32_t first = dirty >> 32;
+	uint32_t end = dirty;
+	if (first >= end)
+		return;
+
+	size_t offset = (size_t) first * fbcon->pitch;
+	memcpy ((uint8_t *) fbcon->fbmem + offset,
+			(uint8_t *) fbcon->backbuf + offset,
+			(size_t) (end - first) * fbcon->pitch);
 	asm volatile ("" : "+r" (fbcon->fbmem) :: "memory");
 }
 
@@ -239,6 +286,8 @@ fbcon_scroll (struct fbcon *fbcon, uint32_t scroll)
 		for (uint32_t j = 0; j < fbcon->width; j++)
 			putpixel (p, c, bpp);
 	}
+
+	mark_dirty (fbcon, 0, fbcon->height);
 }
 
 /**
@@ -272,6 +321,8 @@ fbcon_blit_character (struct fbcon *fbcon, uint8_t c,
 		for (uint32_t j = 0; j < SYMBOL_WIDTH; j++)
 			putpixel (p, bg, bpp);
 	}
+
+	mark_dirty (fbcon, y, y + LINE_HEIGHT);
 }
 
 /**
@@ -410,6 +461,7 @@ fbcon_add_framebuffer (struct fbcon *fbcon,
 
 	fbcon->cx = 0;
 	fbcon->cy = 0;
+	fbcon->dirty = dirty_none;
 	fbcon->c_background	= get_color (fmt,  35,  38,  39);
 	fbcon->c_info		= get_color (fmt, 200, 200, 200);
 	fbcon->c_notice		= get_color (fmt, 255, 255, 255);
@@ -424,6 +476,7 @@ fbcon_add_framebuffer (struct fbcon *fbcon,
 		for (uint32_t j = 0; j < fbcon->width; j++)
 			putpixel (p, c, bpp);
 	}
+	mark_dirty (fbcon, 0, fbcon->height);
 	fbcon_flush (fbcon);
 
 	fbcon->con.emit_message = fbcon_emit_message;
@@ -453,5 +506,7 @@ fbcon_get_pixel (struct fbcon *fbcon, uint32_t x, uint32_t y)
 void
 fbcon_put_pixel (struct fbcon *fbcon, uint8_t *pixel, uint32_t color)
 {
+	uint32_t row = (pixel - (uint8_t *) fbcon->backbuf) / fbcon->pitch;
 	putpixel (pixel, color, fbcon->fmt.bpp);
+	mark_dirty (fbcon, row, row + 1);
 }
@@ -16,4 +16,8 @@
 #define CONFIG_MAX_NR_CPUS 256
 #endif
 
+#ifndef CONFIG_MAX_NR_NODES
+#define CONFIG_MAX_NR_NODES 8
+#endif
+
 #endif /** __davix_predef_h_included */
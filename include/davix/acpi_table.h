@@ -18,3 +18,11 @@ acpi_parse_madt (acpi_madt *madt,
 {
 	return acpi_parse_subtable (&madt->hdr, sizeof (*madt), callback, arg);
 }
+
+static inline uacpi_iteration_decision
+acpi_parse_srat (acpi_srat *srat,
+		uacpi_iteration_decision (*callback) (acpi_entry_hdr *, void *),
+		void *arg)
+{
+	return acpi_parse_subtable (&srat->hdr, sizeof (*srat), callback, arg);
+}
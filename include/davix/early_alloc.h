@@ -17,6 +17,12 @@
 void
 early_free_everything_to_pgalloc (void);
 
+void
+early_free_deferred_to_pgalloc (void);
+
+uintptr_t
+early_defer_page_map (uintptr_t start, uintptr_t end);
+
 uintptr_t
 early_alloc_phys_range (size_t size, size_t align, uintptr_t low, uintptr_t high);
 
@@ -30,6 +30,7 @@ struct fbcon {
 	void *fbmem, *backbuf;
 	unsigned int flags;
 	uint32_t cx, cy;
+	uint64_t dirty;		/** first << 32 | end of the dirty rows */
 	uint32_t c_background;
 	uint32_t c_info;
 	uint32_t c_notice;
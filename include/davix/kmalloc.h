@@ -15,3 +15,20 @@ kmalloc (size_t size, allocation_class aclass);
 
 void
 kfree (void *ptr);
+
+struct RCUHead;
+
+void
+kfree_rcu_ptr (void *ptr, RCUHead *head);
+
+/**
+ * kfree_rcu - free a kmalloc'ed object after an RCU grace period.
+ * @ptr: the object
+ * @field: name of an RCUHead member of *@ptr
+ *
+ * Pointers are collected in per-CPU batches that are freed together after a
+ * grace period.  @field is only used if no memory for a batch is available.
+ */
+#define kfree_rcu(ptr, field) ({			\
+	auto *__kfree_rcu_p = (ptr);			\
+	kfree_rcu_ptr (__kfree_rcu_p, &__kfree_rcu_p->field); })
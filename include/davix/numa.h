@@ -0,0 +1,57 @@
+/**
+ * Non-uniform memory access (NUMA) topology.
+ * Copyright (C) 2025-present  dbstream
+ */
+#pragma once
+
+#include <stdint.h>
+
+extern int nr_nodes;
+extern int cpu_to_node_array[];
+extern int node_fallback_array[][CONFIG_MAX_NR_NODES];
+
+/**
+ * cpu_to_node - get the node that a CPU belongs to.
+ * @cpu: the CPU
+ */
+static inline int
+cpu_to_node (unsigned int cpu)
+{
+	return cpu_to_node_array[cpu];
+}
+
+/**
+ * node_fallback - get the i-th closest node to a node.
+ * @node: the node
+ * @i: index into the fallback order, 0 <= @i < nr_nodes
+ *
+ * node_fallback (@node, 0) is normally @node itself.
+ */
+static inline int
+node_fallback (int node, int i)
+{
+	return node_fallback_array[node][i];
+}
+
+int
+phys_to_node (uintptr_t phys);
+
+unsigned int
+node_distance (int from, int to);
+
+/**
+ * The following are used by architecture code to describe the topology of the
+ * machine during arch_init.  Nodes are numbered from zero.  Memory that was not
+ * described, and CPUs that were not assigned a node, belong to node zero.
+ */
+void
+numa_add_memory (int node, uintptr_t start, uintptr_t end);
+
+void
+numa_set_cpu_node (unsigned int cpu, int node);
+
+void
+numa_set_distance (int from, int to, unsigned int distance);
+
+void
+numa_init (int nr);
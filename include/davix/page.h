@@ -6,7 +6,9 @@
 
 #include <asm/page_defs.h>
 #include <davix/allocation_class.h>
+#include <davix/rcu.h>
 #include <dsl/list.h>
+#include <stddef.h>
 
 static inline pfn_t
 phys_to_pfn (uintptr_t phys)
@@ -25,20 +27,51 @@ pfn_to_phys (pfn_t pfn)
 
 struct SlabAllocator;
 
-typedef unsigned long PageFlags;
+typedef unsigned int PageFlags;
 enum : PageFlags {
 	PAGE_SLAB			= 1UL << 0,
+	PAGE_BUDDY			= 1UL << 1,
+	PAGE_LARGE			= 1UL << 2,
+	PAGE_TAIL			= 1UL << 3,
 };
 
+/**
+ * The page allocator hands out naturally-aligned blocks of 2^order pages, up to
+ * and including max_page_order.
+ */
+constexpr unsigned int max_page_order = 10;
+
 struct Page {
 	dsl::ListHead node;
-	unsigned long flags;
+	PageFlags flags;
+
+	/** NUMA node of the page; set when the page is given to pgalloc.  */
+	int nid;
+
 	union {
 		struct {
 			unsigned int nfree;
+			unsigned int color;
 			void *pobj;
 			SlabAllocator *allocator;
+			void *remote_free;
+			Page *remote_next;
 		} slab;
+		struct {
+			unsigned int order;
+		} buddy;
+		struct {
+			unsigned int order;
+		} large;
+		struct {
+			Page *head;
+		} tail;
+		/**
+		 * Slabs of type-stable caches wait for a grace period before
+		 * they are freed.  This overlaps only slab.nfree, slab.color
+		 * and slab.pobj.
+		 */
+		RCUHead rcu_head;
 		long filler[5];
 	};
 };
@@ -57,6 +90,16 @@ page_to_pfn (Page *page)
 	return page - page_map;
 }
 
+/**
+ * page_head - get the first page of a multi-page slab from any of its pages.
+ * @page: the page
+ */
+static inline Page *
+page_head (Page *page)
+{
+	return (page->flags & PAGE_TAIL) ? page->tail.head : page;
+}
+
 #define phys_to_page(x) pfn_to_page (phys_to_pfn (x))
 #define page_to_phys(x) pfn_to_phys (page_to_pfn (x))
 #define virt_to_page(x) pfn_to_page (virt_to_pfn (x))
@@ -67,11 +110,64 @@ typedef dsl::TypedList<Page, &Page::node> PageList;
 void
 pgalloc_init (void);
 
+void
+pgalloc_init_watermarks (void);
+
+Page *
+alloc_pages (unsigned int order, allocation_class aclass);
+
+Page *
+alloc_pages_node (int node, unsigned int order, allocation_class aclass);
+
+void
+free_pages (Page *page, unsigned int order);
+
+bool
+alloc_pages_bulk (allocation_class aclass, size_t n, PageList *list);
+
+void
+free_pages_bulk (PageList *list);
+
+static inline Page *
+alloc_page (allocation_class aclass)
+{
+	return alloc_pages (0, aclass);
+}
+
+static inline void
+free_page (Page *page)
+{
+	free_pages (page, 0);
+}
+
+void
+contig_init (void);
+
 Page *
-alloc_page (allocation_class aclass);
+alloc_contig (size_t nr_pages, size_t align, allocation_class aclass);
+
+void
+free_contig (Page *page, size_t nr_pages);
+
+bool
+zero_idle_page (void);
+
+/**
+ * A Shrinker is a cache of pages that can give pages back to the page allocator
+ * when memory runs low.  @shrink is called from a DPC with the number of pages
+ * the page allocator would like to get back, and returns the number of pages it
+ * actually freed.  It must not register or unregister shrinkers.
+ */
+struct Shrinker {
+	dsl::ListHead node;
+	size_t (*shrink) (Shrinker *shrinker, size_t nr_pages);
+};
+
+void
+register_shrinker (Shrinker *shrinker);
 
 void
-free_page (Page *page);
+unregister_shrinker (Shrinker *shrinker);
 
 void
 dump_pgalloc_stats (void);
@@ -9,8 +9,40 @@
 
 struct SlabAllocator;
 
+typedef unsigned int slab_flags_t;
+enum : slab_flags_t {
+	/**
+	 * SLAB_TYPESAFE_RCU: the memory of a freed object stays an object of
+	 * the same type at least until the next RCU grace period.  Readers in
+	 * an RCU read-side critical section may thus access objects that are
+	 * concurrently freed and reallocated, but must check that they found
+	 * the object they were looking for.
+	 */
+	SLAB_TYPESAFE_RCU		= 1U << 0,
+
+	/**
+	 * SLAB_CACHELINE_ALIGN: align objects to CACHELINE_SIZE, or to a
+	 * fraction of it for small objects, so that no object shares more
+	 * cache lines than it needs to.
+	 */
+	SLAB_CACHELINE_ALIGN		= 1U << 1,
+};
+
+/**
+ * slab_create - create a slab cache.
+ * @name: name of the cache, for slab_dump
+ * @size: size of the objects
+ * @align: alignment of the objects; zero or a power of two
+ * @flags: SLAB_* flags
+ * @ctor: optional constructor, run on every object when its slab is created
+ *
+ * Objects of caches with a constructor are handed out in their constructed
+ * state, and must be returned to that state before they are freed.  Such
+ * allocations cannot use __ALLOC_ZERO.
+ */
 SlabAllocator *
-slab_create (const char *name, size_t size, size_t align);
+slab_create (const char *name, size_t size, size_t align,
+		slab_flags_t flags = 0, void (*ctor) (void *) = nullptr);
 
 void *
 slab_alloc (SlabAllocator *allocator, allocation_class aclass);
@@ -18,11 +50,59 @@ slab_alloc (SlabAllocator *allocator, allocation_class aclass);
 void
 slab_free (void *ptr);
 
+bool
+slab_alloc_bulk (SlabAllocator *allocator, allocation_class aclass,
+		size_t n, void **objs);
+
+void
+slab_free_bulk (size_t n, void **objs);
+
+void
+slab_set_reserve (SlabAllocator *allocator, size_t nr_slabs);
+
 void
 kmalloc_init (void);
 
 bool
 ptr_is_slab (const void *ptr);
 
+/**
+ * Statistics of a slab cache, as returned by slab_get_stats.  The event counters
+ * count since boot; fast_allocs and fast_frees are the allocations and frees
+ * served by the per-CPU magazines, refills and drains are exchanges of
+ * magazines with the depot, and peak_inuse is the largest number of objects
+ * that were ever taken from the slabs at once.
+ */
+struct slab_stats {
+	char name[32];
+	size_t obj_size;
+	size_t objs_per_slab;
+	unsigned int slab_order;
+
+	size_t nr_slabs;
+	size_t nr_free;
+	size_t nr_depot_full;
+	size_t peak_inuse;
+
+	unsigned long allocs;
+	unsigned long frees;
+	unsigned long fast_allocs;
+	unsigned long fast_frees;
+	unsigned long refills;
+	unsigned long drains;
+	unsigned long slabs_grabbed;
+	unsigned long slabs_released;
+	unsigned long remote_frees;
+};
+
+void
+slab_get_stats (SlabAllocator *allocator, slab_stats *stats);
+
+SlabAllocator *
+slab_find (const char *name);
+
+size_t
+slab_collect_stats (slab_stats *stats, size_t max);
+
 void
 slab_dump (void);
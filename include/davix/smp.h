@@ -15,3 +15,8 @@ smp_handle_call_on_one_ipi (void);
 
 void
 smp_call_on_cpu (unsigned int cpu, void (*fn)(void *), void *arg);
+
+struct cpuset;
+
+void
+smp_call_on_cpus (const cpuset *cpus, void (*fn)(void *), void *arg);
@@ -370,37 +370,37 @@ public:
 	constexpr reverse_iterator
 	rbegin (void)
 	{
-		return reverse_iterator (m_list.prev);
+		return reverse_iterator (m_list.rbegin ());
 	}
 
 	constexpr reverse_iterator
 	rend (void)
 	{
-		return reverse_iterator (&m_list);
+		return reverse_iterator (m_list.rend ());
 	}
 
 	constexpr const_reverse_iterator
 	rbegin (void) const
 	{
-		return const_reverse_iterator (m_list.prev);
+		return const_reverse_iterator (m_list.rbegin ());
 	}
 
 	constexpr const_reverse_iterator
 	rend (void) const
 	{
-		return const_reverse_iterator (&m_list);
+		return const_reverse_iterator (m_list.rend ());
 	}
 
 	constexpr const_reverse_iterator
 	crbegin (void) const
 	{
-		return const_reverse_iterator (m_list.prev);
+		return const_reverse_iterator (m_list.crbegin ());
 	}
 
 	constexpr const_reverse_iterator
 	crend (void) const
 	{
-		return const_reverse_iterator (&m_list);
+		return const_reverse_iterator (m_list.crend ());
 	}
 
 	T *
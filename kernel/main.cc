@@ -185,7 +185,9 @@ start_kernel (void)
 	printk (PR_INFO "CPUs: %d\n", nr_cpus);
 
 	pgalloc_init ();
+	contig_init ();
 	early_free_everything_to_pgalloc ();
+	pgalloc_init_watermarks ();
 	dump_pgalloc_stats ();
 
 	kmalloc_init ();
@@ -214,6 +216,14 @@ setup_and_exec_init (void *arg)
 
 	printk (PR_INFO "Hello from init!\n");
 
+	/*
+	 * Now that all CPUs are online, hand the rest of memory to the page
+	 * allocator.
+	 */
+	early_free_deferred_to_pgalloc ();
+	pgalloc_init_watermarks ();
+	dump_pgalloc_stats ();
+
 	run_ktests ();
 
 	printk (PR_WARN "TODO: execve(/sbin/init)\n");
@@ -6,6 +6,7 @@
  */
 #include <asm/asm.h>
 #include <asm/irql.h>
+#include <davix/page.h>
 #include <davix/rcu.h>
 #include <davix/sched.h>
 
@@ -45,6 +46,14 @@ sched_idle (void)
 {
 	for (;;) {
 		schedule ();
+
+		/*
+		 * Do background work one small step at a time, so that we
+		 * go back to schedule() often.
+		 */
+		if (zero_idle_page ())
+			continue;
+
 		idle_wait ();
 	}
 }
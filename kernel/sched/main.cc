@@ -541,7 +541,8 @@ static SlabAllocator *task_allocator;
 void
 sched_init (void)
 {
-	task_allocator = slab_create ("Task", sizeof (Task), alignof (Task));
+	task_allocator = slab_create ("Task", sizeof (Task), alignof (Task),
+			SLAB_CACHELINE_ALIGN);
 	if (!task_allocator)
 		panic ("Failed to create struct Task allocator!");
 
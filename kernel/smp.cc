@@ -48,9 +48,25 @@ typedef dsl::TypedList<call_on_cpu_data, &call_on_cpu_data::list> SMPCallList;
 struct call_on_cpu_control_block {
 	SMPCallList callback_list;
 	spinlock_t lock;
+
+	/** CPUs whose call_on_cpus_data we must run.  */
+	cpuset multicall_from;
+};
+
+/**
+ * A call to smp_call_on_cpus made by this CPU.  There can only be one at a
+ * time, as smp_call_on_cpus runs with DPCs disabled.
+ */
+struct call_on_cpus_data {
+	void (*fn)(void *);
+	void *arg;
+
+	/** Number of CPUs which have not yet finished the call.  */
+	unsigned int pending;
 };
 
 static DEFINE_PERCPU(call_on_cpu_control_block, smp_call_block);
+static DEFINE_PERCPU(call_on_cpus_data, smp_multicall);
 
 PERCPU_CONSTRUCTOR(smpcall)
 {
@@ -58,6 +74,7 @@ PERCPU_CONSTRUCTOR(smpcall)
 
 	cb->callback_list.init ();
 	cb->lock.init ();
+	cb->multicall_from = {};
 }
 
 static void
@@ -92,6 +109,15 @@ smp_handle_call_on_one_ipi (void)
 		data->fn (data->arg);
 		complete_call_on_cpu (data);
 	}
+
+	for (unsigned int cpu : cb->multicall_from) {
+		cb->multicall_from.clear (cpu);
+		atomic_thread_fence (mo_acquire);
+
+		call_on_cpus_data *data = percpu_ptr (smp_multicall).on (cpu);
+		data->fn (data->arg);
+		atomic_fetch_dec (&data->pending, mo_release);
+	}
 }
 
 /**
@@ -130,3 +156,52 @@ smp_call_on_cpu (unsigned int cpu, void (*fn)(void *), void *arg)
 	enable_dpc ();
 	wait_for_call_on_cpu (&data);
 }
+
+/**
+ * smp_call_on_cpus - call a function on a set of processors in parallel.
+ * @cpus: the processors to call on; these must be online
+ * @fn: function to call; this must be a fast IRQ-safe function
+ * @arg: argument to pass to the function
+ *
+ * The IPIs are sent to all other processors at once, and we then wait for all
+ * of them together.  This function must be called at DPC level or below.
+ */
+void
+smp_call_on_cpus (const cpuset *cpus, void (*fn)(void *), void *arg)
+{
+	disable_dpc ();
+	unsigned int self = this_cpu_id ();
+	call_on_cpus_data *data = percpu_ptr (smp_multicall);
+
+	cpuset others;
+	unsigned int count = 0;
+	for (unsigned int cpu : *cpus) {
+		if (cpu == self)
+			continue;
+
+		others.set (cpu);
+		count++;
+	}
+
+	if (count) {
+		data->fn = fn;
+		data->arg = arg;
+		data->pending = count;
+		atomic_thread_fence (mo_release);
+
+		for (unsigned int cpu : others)
+			percpu_ptr (smp_call_block).on (cpu)->multicall_from.set (self);
+
+		/* Make the requests visible before any of the IPIs are sent.  */
+		atomic_thread_fence (mo_seq_cst);
+		arch_send_smp_call_on_many_IPI (&others, count);
+	}
+
+	if (cpus->get (self))
+		fn (arg);
+
+	while (atomic_load_acquire (&data->pending))
+		smp_spinlock_hint ();
+
+	enable_dpc ();
+}
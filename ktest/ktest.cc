@@ -20,10 +20,31 @@ void ktest_mutex (void);
 static inline void ktest_mutex (void) {}
 #endif
 
+#if CONFIG_KTEST_PGALLOC
+void ktest_pgalloc (void);
+#else
+static inline void ktest_pgalloc (void) {}
+#endif
+
+#if CONFIG_KTEST_SLAB
+void ktest_slab (void);
+#else
+static inline void ktest_slab (void) {}
+#endif
+
+#if CONFIG_KTEST_VMAP
+void ktest_vmap (void);
+#else
+static inline void ktest_vmap (void) {}
+#endif
+
 void
 run_ktests (void)
 {
 	ktest_fireworks ();
 	ktest_mutex ();
+	ktest_pgalloc ();
+	ktest_slab ();
+	ktest_vmap ();
 	ktest_vmatree ();
 }
@@ -0,0 +1,279 @@
+/**
+ * Page allocator ktest module.
+ * Copyright (C) 2025-present  dbstream
+ */
+#include <davix/atomic.h>
+#include <davix/irql.h>
+#include <davix/page.h>
+#include <davix/printk.h>
+#include <davix/sched.h>
+#include <davix/time.h>
+#include <string.h>
+
+static int num_failed;
+
+static void
+fail (const char *what, unsigned int order)
+{
+	printk (PR_WARN "ktest_pgalloc: %s failed at order %u\n", what, order);
+	num_failed++;
+}
+
+/**
+ * free_block_order - find the free block that contains a page.
+ * @page: the page
+ * Returns the order of the block, or -1 if @page is not free.
+ *
+ * Free blocks are naturally aligned, so the head of the block is found by
+ * aligning the pfn down to every possible order in turn.
+ */
+static int
+free_block_order (Page *page)
+{
+	pfn_t pfn = page_to_pfn (page);
+	for (unsigned int order = 0; order <= max_page_order; order++) {
+		Page *head = pfn_to_page (pfn & ~((1UL << order) - 1));
+		if ((head->flags & PAGE_BUDDY) && head->buddy.order == order)
+			return order;
+	}
+
+	return -1;
+}
+
+static void
+test_orders (void)
+{
+	static constexpr unsigned int orders[] = { 0, 1, 3, 6, max_page_order };
+
+	for (unsigned int order : orders) {
+		Page *page = alloc_pages (order, ALLOC_KERNEL);
+		if (!page) {
+			fail ("alloc_pages", order);
+			continue;
+		}
+
+		if (page_to_pfn (page) & ((1UL << order) - 1))
+			fail ("natural alignment", order);
+
+		memset ((void *) page_to_virt (page), 0xa5, PAGE_SIZE << order);
+		free_pages (page, order);
+	}
+}
+
+/**
+ * test_coalesce - free the two halves of a block separately, and check that
+ * they were merged back into a block of at least the original order.
+ *
+ * The orders are above one, so that the halves bypass the per-CPU caches.
+ */
+static void
+test_coalesce (void)
+{
+	static constexpr unsigned int orders[] = { 2, 5, 9, max_page_order };
+
+	for (unsigned int order : orders) {
+		Page *page = alloc_pages (order, ALLOC_KERNEL);
+		if (!page) {
+			fail ("alloc_pages", order);
+			continue;
+		}
+
+		size_t half = 1UL << (order - 1);
+		free_pages (page + half, order - 1);
+		free_pages (page, order - 1);
+
+		int merged = free_block_order (page);
+		if (merged < (int) order) {
+			printk (PR_WARN "ktest_pgalloc: halves of an order-%u block did not coalesce (order %d)\n",
+					order, merged);
+			num_failed++;
+		}
+	}
+}
+
+/**
+ * test_pcp - check that a freed page is what the next allocation on the same
+ * CPU gets, while it is still hot in the cache.
+ */
+static void
+test_pcp (void)
+{
+	scoped_dpc g;
+
+	Page *page = alloc_page (ALLOC_KERNEL);
+	if (!page) {
+		fail ("alloc_page", 0);
+		return;
+	}
+
+	free_page (page);
+	Page *again = alloc_page (ALLOC_KERNEL);
+	if (again != page)
+		fail ("reuse of a page from the per-CPU cache", 0);
+
+	if (again)
+		free_page (again);
+}
+
+static void
+test_bulk (void)
+{
+	static constexpr size_t n = 100;
+
+	PageList list;
+	list.init ();
+	if (!alloc_pages_bulk (ALLOC_KERNEL, n, &list)) {
+		fail ("alloc_pages_bulk", 0);
+		return;
+	}
+
+	size_t count = 0;
+	for (Page *page : list) {
+		if (page->flags & PAGE_BUDDY)
+			fail ("alloc_pages_bulk returned a free page", 0);
+		count++;
+	}
+
+	if (count != n)
+		fail ("alloc_pages_bulk count", 0);
+
+	free_pages_bulk (&list);
+	if (!list.empty ())
+		fail ("free_pages_bulk", 0);
+}
+
+static void
+test_zero (void)
+{
+	Page *pages[32];
+	for (Page *&page : pages) {
+		page = alloc_page (ALLOC_KERNEL);
+		if (page)
+			memset ((void *) page_to_virt (page), 0xff, PAGE_SIZE);
+	}
+
+	for (Page *page : pages)
+		if (page)
+			free_page (page);
+
+	for (Page *&page : pages) {
+		page = alloc_page (ALLOC_KERNEL | __ALLOC_ZERO);
+		if (!page) {
+			fail ("alloc_page(__ALLOC_ZERO)", 0);
+			continue;
+		}
+
+		const unsigned long *p = (const unsigned long *) page_to_virt (page);
+		for (size_t i = 0; i < PAGE_SIZE / sizeof (long); i++) {
+			if (p[i]) {
+				fail ("__ALLOC_ZERO", 0);
+				break;
+			}
+		}
+	}
+
+	for (Page *page : pages)
+		if (page)
+			free_page (page);
+}
+
+static Shrinker ktest_shrinker;
+static unsigned long nr_shrink_calls;
+
+static size_t
+ktest_shrink (Shrinker *shrinker, size_t nr_pages)
+{
+	(void) shrinker;
+	(void) nr_pages;
+
+	atomic_inc_fetch (&nr_shrink_calls, mo_relaxed);
+	return 0;
+}
+
+/**
+ * test_reserve - take all memory that ordinary allocations can get, and check
+ * that a HIGHPRIO allocation still succeeds and that the shrinkers are run.
+ */
+static void
+test_reserve (void)
+{
+	static constexpr nsecs_t timeout = 1000000000;
+
+	ktest_shrinker.shrink = ktest_shrink;
+	register_shrinker (&ktest_shrinker);
+
+	PageList held[max_page_order + 1];
+	for (unsigned int order = max_page_order + 1; order--; ) {
+		held[order].init ();
+		while (Page *page = alloc_pages (order, ALLOC_KERNEL))
+			held[order].push_back (page);
+	}
+
+	Page *page = alloc_page (ALLOC_KERNEL | __ALLOC_HIGHPRIO);
+	if (page)
+		free_page (page);
+	else
+		fail ("alloc_page(__ALLOC_HIGHPRIO)", 0);
+
+	nsecs_t expiry = ns_since_boot () + timeout;
+	while (!atomic_load_relaxed (&nr_shrink_calls)) {
+		if (ns_since_boot () > expiry) {
+			fail ("running the shrinkers", 0);
+			break;
+		}
+
+		sched_timeout (ns_since_boot () + 10000000, TASK_UNINTERRUPTIBLE);
+	}
+
+	for (unsigned int order = 0; order <= max_page_order; order++)
+		while (!held[order].empty ())
+			free_pages (held[order].pop_front (), order);
+
+	unregister_shrinker (&ktest_shrinker);
+}
+
+static void
+test_contig (void)
+{
+	static constexpr size_t nr_pages = 7;
+	static constexpr size_t align_pages = 32;
+
+	Page *page = alloc_contig (nr_pages, align_pages * PAGE_SIZE,
+			ALLOC_KERNEL | __ALLOC_ZERO);
+	if (!page) {
+		fail ("alloc_contig", 0);
+		return;
+	}
+
+	if (page_to_pfn (page) & (align_pages - 1))
+		fail ("alloc_contig alignment", 0);
+
+	const unsigned long *p = (const unsigned long *) page_to_virt (page);
+	for (size_t i = 0; i < nr_pages * PAGE_SIZE / sizeof (long); i++) {
+		if (p[i]) {
+			fail ("alloc_contig(__ALLOC_ZERO)", 0);
+			break;
+		}
+	}
+
+	free_contig (page, nr_pages);
+}
+
+void
+ktest_pgalloc (void)
+{
+	printk (PR_NOTICE "Running page allocator ktests...\n");
+
+	test_orders ();
+	test_coalesce ();
+	test_pcp ();
+	test_bulk ();
+	test_zero ();
+	test_reserve ();
+	test_contig ();
+
+	if (num_failed == 0)
+		printk (PR_NOTICE "ktest_pgalloc: SUCCESS!\n");
+	else
+		printk (PR_ERROR "ktest_pgalloc: FAIL!  %d checks failed.\n", num_failed);
+}
@@ -0,0 +1,296 @@
+/**
+ * Slab allocator ktest module.
+ * Copyright (C) 2025-present  dbstream
+ */
+#include <davix/atomic.h>
+#include <davix/kmalloc.h>
+#include <davix/page.h>
+#include <davix/printk.h>
+#include <davix/rcu.h>
+#include <davix/sched.h>
+#include <davix/slab.h>
+#include <davix/time.h>
+#include <string.h>
+
+static constexpr unsigned long obj_magic = 0x5ab5ab5ab5ab5abUL;
+
+struct ktest_obj {
+	unsigned long magic;
+	size_t index;
+	RCUHead rcu;
+	char pad[40];
+};
+
+static SlabAllocator *obj_alloc;
+static unsigned long nr_ctor_calls;
+static int num_failed;
+
+static void
+fail (const char *what)
+{
+	printk (PR_WARN "ktest_slab: %s failed\n", what);
+	num_failed++;
+}
+
+static void
+obj_ctor (void *ptr)
+{
+	ktest_obj *obj = (ktest_obj *) ptr;
+	obj->magic = obj_magic;
+	atomic_inc_fetch (&nr_ctor_calls, mo_relaxed);
+}
+
+/**
+ * check_objs - check that objects are constructed and distinct.
+ *
+ * Every object is tagged with its index first, so that an object handed out
+ * twice is caught by a mismatching tag.
+ */
+static void
+check_objs (ktest_obj **objs, size_t n, const char *what)
+{
+	for (size_t i = 0; i < n; i++)
+		objs[i]->index = i;
+
+	for (size_t i = 0; i < n; i++) {
+		if (objs[i]->magic != obj_magic) {
+			printk (PR_WARN "ktest_slab: %s returned an unconstructed object\n", what);
+			num_failed++;
+			return;
+		}
+
+		if (objs[i]->index != i) {
+			printk (PR_WARN "ktest_slab: %s returned an object twice\n", what);
+			num_failed++;
+			return;
+		}
+	}
+}
+
+static void
+test_ctor (void)
+{
+	static constexpr size_t n = 200;
+	ktest_obj *objs[n];
+
+	for (size_t i = 0; i < n; i++) {
+		objs[i] = (ktest_obj *) slab_alloc (obj_alloc, ALLOC_KERNEL);
+		if (!objs[i]) {
+			fail ("slab_alloc");
+			while (i)
+				slab_free (objs[--i]);
+			return;
+		}
+	}
+
+	check_objs (objs, n, "slab_alloc");
+	if (atomic_load_relaxed (&nr_ctor_calls) < n)
+		fail ("constructor count");
+
+	for (ktest_obj *obj : objs)
+		slab_free (obj);
+}
+
+/**
+ * test_typesafe_rcu - check that freed objects of a SLAB_TYPESAFE_RCU cache
+ * stay constructed objects of the cache during an RCU read-side section.
+ */
+static void
+test_typesafe_rcu (void)
+{
+	static constexpr size_t n = 200;
+	ktest_obj *objs[n];
+
+	SlabAllocator *rcu_alloc = slab_create ("ktest_slab_rcu",
+			sizeof (ktest_obj), alignof (ktest_obj),
+			SLAB_TYPESAFE_RCU, obj_ctor);
+	if (!rcu_alloc) {
+		fail ("slab_create(SLAB_TYPESAFE_RCU)");
+		return;
+	}
+
+	size_t nr = 0;
+	for (; nr < n; nr++) {
+		objs[nr] = (ktest_obj *) slab_alloc (rcu_alloc, ALLOC_KERNEL);
+		if (!objs[nr]) {
+			fail ("slab_alloc");
+			break;
+		}
+	}
+
+	rcu_read_lock ();
+	for (size_t i = 0; i < nr; i++)
+		slab_free (objs[i]);
+
+	for (size_t i = 0; i < nr; i++) {
+		Page *page = page_head (virt_to_page ((uintptr_t) objs[i]));
+		if (objs[i]->magic != obj_magic
+				|| page->slab.allocator != rcu_alloc) {
+			fail ("SLAB_TYPESAFE_RCU");
+			break;
+		}
+	}
+	rcu_read_unlock ();
+}
+
+static void
+test_bulk (void)
+{
+	static constexpr size_t n = 64;
+	ktest_obj *objs[n];
+
+	if (!slab_alloc_bulk (obj_alloc, ALLOC_KERNEL, n, (void **) objs)) {
+		fail ("slab_alloc_bulk");
+		return;
+	}
+
+	check_objs (objs, n, "slab_alloc_bulk");
+	slab_free_bulk (n, (void **) objs);
+}
+
+/**
+ * test_kfree_rcu - check that objects passed to kfree_rcu are eventually freed.
+ *
+ * The objects are served by the page allocator, so that their freeing shows
+ * in the flags of their pages.
+ */
+static void
+test_kfree_rcu (void)
+{
+	static constexpr size_t n = 16;
+	static constexpr size_t size = 2 * PAGE_SIZE;
+	static constexpr nsecs_t timeout = 2000000000;
+
+	Page *pages[n];
+	size_t nr = 0;
+	for (; nr < n; nr++) {
+		ktest_obj *obj = (ktest_obj *) kmalloc (size, ALLOC_KERNEL);
+		if (!obj) {
+			fail ("kmalloc");
+			break;
+		}
+
+		pages[nr] = virt_to_page ((uintptr_t) obj);
+		kfree_rcu (obj, rcu);
+	}
+
+	nsecs_t expiry = ns_since_boot () + timeout;
+	for (size_t i = 0; i < nr; i++) {
+		while (atomic_load_relaxed (&pages[i]->flags) & PAGE_LARGE) {
+			if (ns_since_boot () > expiry) {
+				fail ("kfree_rcu");
+				return;
+			}
+
+			sched_timeout (ns_since_boot () + 10000000, TASK_UNINTERRUPTIBLE);
+		}
+	}
+}
+
+/**
+ * test_stats - check that the statistics of a cache count every allocation and
+ * every free.
+ */
+static void
+test_stats (void)
+{
+	static constexpr size_t n = 64;
+	ktest_obj *objs[n];
+
+	if (slab_find ("ktest_slab") != obj_alloc)
+		fail ("slab_find");
+
+	slab_stats before, after;
+	slab_get_stats (obj_alloc, &before);
+
+	for (size_t i = 0; i < n; i++) {
+		objs[i] = (ktest_obj *) slab_alloc (obj_alloc, ALLOC_KERNEL);
+		if (!objs[i]) {
+			fail ("slab_alloc");
+			while (i)
+				slab_free (objs[--i]);
+			return;
+		}
+	}
+
+	for (ktest_obj *obj : objs)
+		slab_free (obj);
+
+	if (!slab_alloc_bulk (obj_alloc, ALLOC_KERNEL, n, (void **) objs)) {
+		fail ("slab_alloc_bulk");
+		return;
+	}
+
+	slab_free_bulk (n, (void **) objs);
+	slab_get_stats (obj_alloc, &after);
+
+	if (strcmp (after.name, "ktest_slab"))
+		fail ("slab_get_stats name");
+	if (after.allocs - before.allocs != 2 * n)
+		fail ("counting allocations");
+	if (after.frees - before.frees != 2 * n)
+		fail ("counting frees");
+}
+
+static void
+test_kmalloc (void)
+{
+	static constexpr size_t sizes[] = {
+		1, 8, 96, 100, 3072, 3073, 8192, 65536, 5UL << 20
+	};
+
+	for (size_t size : sizes) {
+		void *ptr = kmalloc (size, ALLOC_KERNEL);
+		if (!ptr) {
+			printk (PR_WARN "ktest_slab: kmalloc(%zu) failed\n", size);
+			num_failed++;
+			continue;
+		}
+
+		memset (ptr, 0xff, size);
+		kfree (ptr);
+
+		const unsigned char *p = (const unsigned char *) kmalloc (size,
+				ALLOC_KERNEL | __ALLOC_ZERO);
+		if (!p) {
+			printk (PR_WARN "ktest_slab: kmalloc(%zu, __ALLOC_ZERO) failed\n", size);
+			num_failed++;
+			continue;
+		}
+
+		for (size_t i = 0; i < size; i++) {
+			if (p[i]) {
+				printk (PR_WARN "ktest_slab: kmalloc(%zu, __ALLOC_ZERO) is not zeroed\n", size);
+				num_failed++;
+				break;
+			}
+		}
+
+		kfree ((void *) p);
+	}
+}
+
+void
+ktest_slab (void)
+{
+	printk (PR_NOTICE "Running slab ktests...\n");
+
+	obj_alloc = slab_create ("ktest_slab", sizeof (ktest_obj),
+			alignof (ktest_obj), 0, obj_ctor);
+	if (!obj_alloc) {
+		printk (PR_ERROR "ktest_slab: FAIL!  slab_create failed.\n");
+		return;
+	}
+
+	test_ctor ();
+	test_typesafe_rcu ();
+	test_bulk ();
+	test_kfree_rcu ();
+	test_stats ();
+	test_kmalloc ();
+
+	if (num_failed == 0)
+		printk (PR_NOTICE "ktest_slab: SUCCESS!\n");
+	else
+		printk (PR_ERROR "ktest_slab: FAIL!  %d checks failed.\n", num_failed);
+}
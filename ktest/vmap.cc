@@ -0,0 +1,167 @@
+/**
+ * vmap ktest module.
+ * Copyright (C) 2025-present  dbstream
+ */
+#include <davix/page.h>
+#include <davix/printk.h>
+#include <davix/vmap.h>
+#include <string.h>
+
+static int num_failed;
+
+static void
+fail (const char *what)
+{
+	printk (PR_WARN "ktest_vmap: %s failed\n", what);
+	num_failed++;
+}
+
+static inline unsigned long
+pattern (size_t i, unsigned long seed)
+{
+	return (i * 0x9e3779b97f4a7c15UL) ^ seed;
+}
+
+static void
+fill (void *mem, size_t size, unsigned long seed)
+{
+	unsigned long *p = (unsigned long *) mem;
+	for (size_t i = 0; i < size / sizeof (long); i++)
+		p[i] = pattern (i, seed);
+}
+
+static bool
+check (const void *mem, size_t size, unsigned long seed)
+{
+	const unsigned long *p = (const unsigned long *) mem;
+	for (size_t i = 0; i < size / sizeof (long); i++)
+		if (p[i] != pattern (i, seed))
+			return false;
+	return true;
+}
+
+/**
+ * test_alias - map a block of pages and check that the mapping and the direct
+ * map show the same memory, in both directions.
+ * @order: order of the block
+ * @unmap_offset: offset into the mapping of the pointer passed to vunmap
+ */
+static void
+test_alias (unsigned int order, size_t unmap_offset)
+{
+	size_t size = PAGE_SIZE << order;
+	Page *page = alloc_pages (order, ALLOC_KERNEL);
+	if (!page) {
+		fail ("alloc_pages");
+		return;
+	}
+
+	void *direct = (void *) page_to_virt (page);
+	fill (direct, size, order);
+
+	void *mapped = vmap (page_to_phys (page), size);
+	if (!mapped) {
+		fail ("vmap");
+		free_pages (page, order);
+		return;
+	}
+
+	/* Mappings of whole huge pages should be aligned to use them.  */
+	if (size >= P1D_SIZE && ((uintptr_t) mapped & (P1D_SIZE - 1)))
+		fail ("huge page alignment");
+
+	if (!check (mapped, size, order))
+		fail ("reading through vmap");
+
+	fill (mapped, size, ~order);
+	if (!check (direct, size, ~order))
+		fail ("writing through vmap");
+
+	vunmap ((char *) mapped + unmap_offset);
+	free_pages (page, order);
+}
+
+/**
+ * test_churn - map and unmap single pages many times over.
+ *
+ * This is several times lazy_max_pages, so it goes through lazy purges
+ * and through many vmap blocks.
+ */
+static void
+test_churn (void)
+{
+	Page *page = alloc_page (ALLOC_KERNEL);
+	if (!page) {
+		fail ("alloc_page");
+		return;
+	}
+
+	fill ((void *) page_to_virt (page), PAGE_SIZE, 42);
+	for (int i = 0; i < 30000; i++) {
+		void *mapped = vmap (page_to_phys (page), PAGE_SIZE);
+		if (!mapped) {
+			fail ("vmap churn");
+			break;
+		}
+
+		if (!check (mapped, PAGE_SIZE, 42)) {
+			fail ("reading through vmap churn");
+			vunmap (mapped);
+			break;
+		}
+
+		vunmap (mapped);
+	}
+
+	free_page (page);
+}
+
+/**
+ * test_kmalloc_large - check that large allocations are usable and disjoint.
+ */
+static void
+test_kmalloc_large (void)
+{
+	static constexpr size_t sizes[] = {
+		PAGE_SIZE, 3 * PAGE_SIZE, 16 * PAGE_SIZE, 17 * PAGE_SIZE,
+		5UL << 20
+	};
+
+	void *ptrs[sizeof (sizes) / sizeof (sizes[0])];
+	for (size_t i = 0; i < sizeof (sizes) / sizeof (sizes[0]); i++) {
+		ptrs[i] = kmalloc_large (sizes[i]);
+		if (ptrs[i])
+			fill (ptrs[i], sizes[i], i);
+		else
+			fail ("kmalloc_large");
+	}
+
+	for (size_t i = 0; i < sizeof (sizes) / sizeof (sizes[0]); i++) {
+		if (!ptrs[i])
+			continue;
+
+		if (!check (ptrs[i], sizes[i], i))
+			fail ("kmalloc_large allocations overlap");
+
+		/* Free some of them through a pointer into the middle.  */
+		kfree_large ((char *) ptrs[i] + (i & 1) * (sizes[i] / 2));
+	}
+}
+
+void
+ktest_vmap (void)
+{
+	printk (PR_NOTICE "Running vmap ktests...\n");
+
+	test_alias (0, 0);
+	test_alias (2, 2 * PAGE_SIZE + 123);
+	test_alias (4, 0);
+	test_alias (9, P1D_SIZE - 1);
+	test_churn ();
+	test_kmalloc_large ();
+
+	if (num_failed == 0)
+		printk (PR_NOTICE "ktest_vmap: SUCCESS!\n");
+	else
+		printk (PR_ERROR "ktest_vmap: FAIL!  %d checks failed.\n", num_failed);
+}
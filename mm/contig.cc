@@ -0,0 +1,235 @@
+/**
+ * Physically contiguous allocations.
+ * Copyright (C) 2025-present  dbstream
+ *
+ * alloc_contig hands out physically contiguous runs of pages with a given
+ * alignment, as needed for DMA rings and bounce buffers.  Runs that fit in a
+ * buddy block come from the page allocator, and the unused tail of the block is
+ * freed right away.
+ *
+ * Larger runs come from a region below 4 GiB that is reserved at boot through
+ * the "cma=<size>" command line parameter, and which is managed with a simple
+ * first-fit bitmap.  Unlike CMA on other systems, we have no movable pages to
+ * lend the region to in the meantime, so it stays reserved for alloc_contig.
+ */
+#include <asm/zone.h>
+#include <davix/cmdline.h>
+#include <davix/early_alloc.h>
+#include <davix/page.h>
+#include <davix/printk.h>
+#include <davix/spinlock.h>
+#include <dsl/align.h>
+#include <dsl/minmax.h>
+#include <string.h>
+
+static pfn_t cma_base;
+static size_t cma_pages;
+static unsigned long *cma_bitmap;
+static spinlock_t cma_lock;
+
+static constexpr size_t bits_per_long = 8 * sizeof (unsigned long);
+
+static inline bool
+cma_test (size_t i)
+{
+	return cma_bitmap[i / bits_per_long] & (1UL << (i % bits_per_long));
+}
+
+static inline void
+cma_assign (size_t i, size_t n, bool value)
+{
+	for (; n; i++, n--) {
+		if (value)
+			cma_bitmap[i / bits_per_long] |= 1UL << (i % bits_per_long);
+		else
+			cma_bitmap[i / bits_per_long] &= ~(1UL << (i % bits_per_long));
+	}
+}
+
+/**
+ * parse_size - parse a size with an optional K, M or G suffix.
+ * @value: pointer to string returned by get_early_param
+ * Returns the size in bytes, or zero if @value is malformed.
+ */
+static size_t
+parse_size (const char *value)
+{
+	if (*value++ != '=')
+		return 0;
+
+	size_t size = 0;
+	if (*value < '0' || *value > '9')
+		return 0;
+	for (; *value >= '0' && *value <= '9'; value++)
+		size = size * 10 + (*value - '0');
+
+	switch (*value) {
+	case 'G': case 'g': size <<= 10; [[fallthrough]];
+	case 'M': case 'm': size <<= 10; [[fallthrough]];
+	case 'K': case 'k': size <<= 10; value++; break;
+	default: break;
+	}
+
+	if (*value && *value != ' ' && *value != '\t')
+		return 0;
+	return size;
+}
+
+/**
+ * contig_init - reserve the region for large contiguous allocations.
+ *
+ * This must be called after pgalloc_init, but before the early allocator hands
+ * its memory to the page allocator.
+ */
+void
+contig_init (void)
+{
+	cma_lock.init ();
+
+	const char *value = get_early_param ("cma", 0);
+	if (!value)
+		return;
+
+	size_t size = dsl::align_up (parse_size (value), PAGE_SIZE);
+	if (!size) {
+		printk (PR_WARN "contig: ignoring malformed cma parameter\n");
+		return;
+	}
+
+	size_t npages = size / PAGE_SIZE;
+	size_t bitmap_size = dsl::align_up (npages, bits_per_long) / 8;
+	uintptr_t phys = early_alloc_phys_zone (size,
+			PAGE_SIZE << max_page_order, ZONE_LOW4G);
+	cma_bitmap = (unsigned long *) early_alloc_virt (bitmap_size,
+			sizeof (unsigned long));
+
+	if (!phys || !cma_bitmap) {
+		printk (PR_WARN "contig: failed to reserve %zu KiB for cma\n",
+				size / 1024);
+		if (phys)
+			early_free_phys (phys, size);
+		if (cma_bitmap)
+			early_free_virt (cma_bitmap, bitmap_size);
+		cma_bitmap = nullptr;
+		return;
+	}
+
+	memset (cma_bitmap, 0, bitmap_size);
+	cma_base = phys_to_pfn (phys);
+	cma_pages = npages;
+	printk (PR_INFO "contig: reserved %zu KiB at 0x%lx for cma\n",
+			size / 1024, phys);
+}
+
+/**
+ * cma_alloc - allocate a run of pages from the reserved region.
+ */
+static Page *
+cma_alloc (size_t nr_pages, size_t align_pages)
+{
+	scoped_spinlock_dpc g (cma_lock);
+
+	/* The region itself is aligned to the largest buddy block.  */
+	size_t i = dsl::align_up (cma_base, align_pages) - cma_base;
+	while (i + nr_pages <= cma_pages) {
+		size_t j = 0;
+		while (j < nr_pages && !cma_test (i + j))
+			j++;
+
+		if (j == nr_pages) {
+			cma_assign (i, nr_pages, true);
+			return pfn_to_page (cma_base + i);
+		}
+
+		i = dsl::align_up (cma_base + i + j + 1, align_pages) - cma_base;
+	}
+
+	return nullptr;
+}
+
+static inline bool
+page_in_cma (Page *page)
+{
+	pfn_t pfn = page_to_pfn (page);
+	return cma_pages && cma_base <= pfn && pfn < cma_base + cma_pages;
+}
+
+/**
+ * free_pages_range - free a run of pages to the page allocator.
+ * @page: first page of the run
+ * @nr_pages: number of pages in the run
+ *
+ * The run is freed as the largest naturally-aligned blocks that fit in it.
+ */
+static void
+free_pages_range (Page *page, size_t nr_pages)
+{
+	while (nr_pages) {
+		pfn_t pfn = page_to_pfn (page);
+		unsigned int order = max_page_order;
+		while (order && ((pfn & ((1UL << order) - 1))
+				|| (1UL << order) > nr_pages))
+			order--;
+
+		free_pages (page, order);
+		page += 1UL << order;
+		nr_pages -= 1UL << order;
+	}
+}
+
+/**
+ * alloc_contig - allocate a physically contiguous run of pages.
+ * @nr_pages: number of pages to allocate
+ * @align: required alignment in bytes; zero or a power of two
+ * @aclass: allocation class
+ * Returns the first page of the run, or NULL on failure.
+ */
+Page *
+alloc_contig (size_t nr_pages, size_t align, allocation_class aclass)
+{
+	if (!nr_pages)
+		return nullptr;
+
+	size_t align_pages = dsl::max (align / PAGE_SIZE, 1UL);
+	size_t block = dsl::max (nr_pages, align_pages);
+	unsigned int order = 0;
+	while ((1UL << order) < block)
+		order++;
+
+	Page *page = nullptr;
+	if (order <= max_page_order) {
+		page = alloc_pages (order, aclass & ~__ALLOC_ZERO);
+		if (page && (1UL << order) > nr_pages)
+			free_pages_range (page + nr_pages,
+					(1UL << order) - nr_pages);
+	}
+
+	/*
+	 * The reserved region lies above 1 MiB, so it is of no use to
+	 * __ALLOC_LOW1M allocations.
+	 */
+	if (!page && cma_pages && allocation_zone (aclass) != ZONE_LOW1M)
+		page = cma_alloc (nr_pages, align_pages);
+
+	if (page && (aclass & __ALLOC_ZERO))
+		memset ((void *) page_to_virt (page), 0, nr_pages * PAGE_SIZE);
+
+	return page;
+}
+
+/**
+ * free_contig - free a run of pages allocated with alloc_contig.
+ * @page: first page of the run
+ * @nr_pages: the number of pages that was passed to alloc_contig
+ */
+void
+free_contig (Page *page, size_t nr_pages)
+{
+	if (!page_in_cma (page)) {
+		free_pages_range (page, nr_pages);
+		return;
+	}
+
+	scoped_spinlock_dpc g (cma_lock);
+	cma_assign (page_to_pfn (page) - cma_base, nr_pages, false);
+}
@@ -7,12 +7,21 @@
  * online.
  */
 #include <asm/zone.h>
+#include <davix/atomic.h>
+#include <davix/condwait.h>
+#include <davix/cpuset.h>
 #include <davix/early_alloc.h>
+#include <davix/kthread.h>
+#include <davix/numa.h>
 #include <davix/page.h>
+#include <davix/printk.h>
+#include <davix/spinlock.h>
+#include <davix/time.h>
 #include <dsl/align.h>
 #include <dsl/list.h>
 #include <dsl/minmax.h>
 #include <new>
+#include <string.h>
 
 struct early_free_block {
 	dsl::ListHead linkage;
@@ -24,13 +33,133 @@ static_assert (minalign >= sizeof (early_free_block));
 
 static dsl::TypedList<early_free_block, &early_free_block::linkage> free_list;
 
+/**
+ * launder_phys_uintptr - begin the lifetime of a new object at addr.
+ * @addr: physical address of storage location
+ * @size: size of storage location
+ * Returns addr.
+ *
+ * This function is needed to kill compiler aliasing analysis, which might
+ * otherwise classify some things we do as UB.
+ */
+static uintptr_t
+launder_phys_uintptr (uintptr_t addr, size_t size)
+{
+	return virt_to_phys (
+		(uintptr_t) new (
+			(void *) phys_to_virt (addr)
+		) unsigned char[size]
+	);
+}
+
+/**
+ * Initialization of the struct Page map and of the free lists is deferred for
+ * all memory at or above deferred_init_start, i.e. the default zone.  Once all
+ * CPUs are online, early_free_deferred_to_pgalloc splits this work between
+ * them.  Until then, nobody looks at the struct Page of that memory.
+ */
+static constexpr uintptr_t deferred_init_start = zone_minaddr (ZONE_DEFAULT);
+static_assert (deferred_init_start % (PAGE_SIZE << max_page_order) == 0);
+
+struct deferred_page_map_range {
+	uintptr_t start;
+	uintptr_t end;
+};
+
+static constexpr int max_deferred_page_map = 64;
+
+static deferred_page_map_range deferred_page_map[max_deferred_page_map];
+static int nr_deferred_page_map;
+
+static dsl::TypedList<early_free_block, &early_free_block::linkage> deferred_list;
+static spinlock_t deferred_lock;
+
+/**
+ * early_defer_page_map - defer zeroing part of the struct Page map.
+ * @start: start address of a freshly-mapped part of the page_map
+ * @end: end address of a freshly-mapped part of the page_map
+ * Returns the address from which zeroing was deferred, or @end if the caller
+ * has to zero everything itself.
+ */
+uintptr_t
+early_defer_page_map (uintptr_t start, uintptr_t end)
+{
+	uintptr_t defer = dsl::max (start,
+			(uintptr_t) phys_to_page (deferred_init_start));
+	if (defer >= end)
+		return end;
+
+	if (nr_deferred_page_map) {
+		deferred_page_map_range *last =
+			&deferred_page_map[nr_deferred_page_map - 1];
+
+		if (last->start <= defer && defer <= last->end) {
+			last->end = dsl::max (last->end, end);
+			return defer;
+		}
+	}
+
+	if (nr_deferred_page_map == max_deferred_page_map)
+		return end;
+
+	deferred_page_map[nr_deferred_page_map].start = defer;
+	deferred_page_map[nr_deferred_page_map].end = end;
+	nr_deferred_page_map++;
+	return defer;
+}
+
+/**
+ * free_range_to_pgalloc - free a page-aligned range of memory to pgalloc.
+ * @addr: physical address of the range
+ * @npages: number of pages in the range
+ */
+static void
+free_range_to_pgalloc (uintptr_t addr, size_t npages)
+{
+	while (npages) {
+		/*
+		 * Free the largest naturally-aligned block that fits and does
+		 * not straddle a zone or node boundary.
+		 */
+		unsigned int order = max_page_order;
+		pfn_t pfn = phys_to_pfn (addr);
+		int node = phys_to_node (addr);
+		for (; order; order--) {
+			uintptr_t last = addr + (PAGE_SIZE << order) - 1;
+			if ((pfn & ((1UL << order) - 1)) || (1UL << order) > npages)
+				continue;
+			if (phys_to_zone (addr) == phys_to_zone (last)
+					&& node == phys_to_node (last))
+				break;
+		}
+
+		/*
+		 * Record the node in every page, so that the page allocator
+		 * does not have to look it up whenever a page is freed.
+		 */
+		Page *page = phys_to_page (addr);
+		for (size_t i = 0; i < (1UL << order); i++)
+			page[i].nid = node;
+
+		free_pages (page, order);
+		addr += PAGE_SIZE << order;
+		npages -= 1UL << order;
+	}
+}
+
 /**
  * early_free_everything_to_pgalloc - free all early_alloc managed blocks to
  * pgalloc, which is assumed to be online now.
+ *
+ * Memory at or above deferred_init_start is kept back for
+ * early_free_deferred_to_pgalloc.
  */
 void
 early_free_everything_to_pgalloc (void)
 {
+	deferred_lock.init ();
+	deferred_list.init ();
+
 	while (!free_list.empty ()) {
 		early_free_block *block = free_list.pop_front ();
 		uintptr_t addr = virt_to_phys ((uintptr_t) block);
@@ -41,29 +170,179 @@ early_free_everything_to_pgalloc (void)
 			continue;
 
 		addr += n;
-		size = (size - n) / PAGE_SIZE;
-		for (; size; addr += PAGE_SIZE, size--)
-			free_page (phys_to_page (addr));
+		uintptr_t end = addr + dsl::align_down (size - n, PAGE_SIZE);
+		if (end > deferred_init_start) {
+			uintptr_t split = dsl::max (addr, deferred_init_start);
+			block = (early_free_block *) phys_to_virt (split);
+			block->size = end - split;
+			deferred_list.push_back (block);
+			end = split;
+		}
+
+		if (addr < end)
+			free_range_to_pgalloc (addr, (end - addr) / PAGE_SIZE);
 	}
 }
 
 /**
- * launder_phys_uintptr - begin the lifetime of a new object at addr.
- * @addr: physical address of storage location
- * @size: size of storage location
- * Returns addr.
+ * Deferred memory is freed to pgalloc in chunks of this many bytes, so that
+ * the work is spread evenly between the CPUs.
+ */
+static constexpr size_t deferred_free_chunk = (PAGE_SIZE << max_page_order) * 32;
+
+/**
+ * The struct Page map is zeroed in chunks of this many bytes.
+ */
+static constexpr size_t deferred_page_map_chunk = 2UL << 20;
+
+static size_t deferred_next_chunk;
+static unsigned int deferred_nr_workers;
+
+/**
+ * zero_page_map_chunk - zero the next chunk of the deferred page_map.
+ * Returns false if there is nothing left to zero.
+ */
+static bool
+zero_page_map_chunk (void)
+{
+	size_t chunk = atomic_fetch_inc (&deferred_next_chunk, mo_relaxed);
+	for (int i = 0; i < nr_deferred_page_map; i++) {
+		deferred_page_map_range *r = &deferred_page_map[i];
+		size_t n = dsl::align_up (r->end - r->start, deferred_page_map_chunk)
+				/ deferred_page_map_chunk;
+		if (chunk >= n) {
+			chunk -= n;
+			continue;
+		}
+
+		uintptr_t start = r->start + chunk * deferred_page_map_chunk;
+		uintptr_t end = dsl::min (start + deferred_page_map_chunk, r->end);
+		memset ((void *) start, 0, end - start);
+		return true;
+	}
+
+	return false;
+}
+
+/**
+ * free_deferred_chunk - free the next chunk of deferred memory to pgalloc.
+ * Returns false if there is nothing left to free.
+ */
+static bool
+free_deferred_chunk (void)
+{
+	uintptr_t addr;
+	size_t size;
+
+	{
+		scoped_spinlock_dpc g (deferred_lock);
+		if (deferred_list.empty ())
+			return false;
+
+		early_free_block *block = deferred_list.pop_front ();
+		addr = virt_to_phys ((uintptr_t) block);
+		size = block->size;
+
+		uintptr_t split = dsl::align_down (addr, deferred_free_chunk)
+				+ deferred_free_chunk;
+		if (split < addr + size) {
+			block = (early_free_block *) phys_to_virt (split);
+			block->size = addr + size - split;
+			deferred_list.push_front (block);
+			size = split - addr;
+		}
+	}
+
+	free_range_to_pgalloc (addr, size / PAGE_SIZE);
+	return true;
+}
+
+enum : uintptr_t {
+	DEFERRED_ZERO_PAGE_MAP,
+	DEFERRED_FREE
+};
+
+static bool
+do_deferred_work (uintptr_t what)
+{
+	if (what == DEFERRED_ZERO_PAGE_MAP)
+		return zero_page_map_chunk ();
+	else
+		return free_deferred_chunk ();
+}
+
+static void
+deferred_init_worker (void *arg)
+{
+	while (do_deferred_work ((uintptr_t) arg))
+		;
+
+	if (!atomic_dec_fetch (&deferred_nr_workers, mo_release))
+		condwait_touch (&deferred_nr_workers);
+
+	kthread_exit ();
+}
+
+/**
+ * run_deferred_work - do some deferred work on all CPUs and wait for it to
+ * complete.
+ * @what: DEFERRED_ZERO_PAGE_MAP or DEFERRED_FREE
+ */
+static void
+run_deferred_work (uintptr_t what)
+{
+	deferred_next_chunk = 0;
+	deferred_nr_workers = 0;
+
+	bool first = true;
+	for (unsigned int cpu : cpu_online) {
+		(void) cpu;
+
+		/* The calling thread takes a share of the work itself.  */
+		if (first) {
+			first = false;
+			continue;
+		}
+
+		Task *task = kthread_create ("pginit", deferred_init_worker,
+				(void *) what);
+		if (!task)
+			break;
+
+		atomic_inc_fetch (&deferred_nr_workers, mo_relaxed);
+		kthread_start (task);
+	}
+
+	while (do_deferred_work (what))
+		;
+
+	condwait (&deferred_nr_workers, arg, atomic_load_acquire (arg) == 0);
+}
+
+/**
+ * early_free_deferred_to_pgalloc - initialize and free all memory that was kept
+ * back by early_free_everything_to_pgalloc.
  *
- * This function is needed to kill compiler aliasing analysis, which might
- * otherwise classify some things we do as UB.
+ * This splits the work between all online CPUs, and must be called from a
+ * thread that can sleep.
  */
-static uintptr_t
-launder_phys_uintptr (uintptr_t addr, size_t size)
+void
+early_free_deferred_to_pgalloc (void)
 {
-	return virt_to_phys (
-		(uintptr_t) new (
-			(void *) phys_to_virt (addr)
-		) unsigned char[size]
-	);
+	if (!nr_deferred_page_map && deferred_list.empty ())
+		return;
+
+	msecs_t start = ms_since_boot ();
+
+	/*
+	 * All of the page_map must be zeroed before we free anything, since the
+	 * page allocator looks at the struct Page of buddy blocks.
+	 */
+	run_deferred_work (DEFERRED_ZERO_PAGE_MAP);
+	run_deferred_work (DEFERRED_FREE);
+
+	printk (PR_INFO "early_alloc: deferred memory initialized in %llu ms\n",
+			(unsigned long long) (ms_since_boot () - start));
 }
 
 /**
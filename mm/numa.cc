@@ -0,0 +1,153 @@
+/**
+ * Non-uniform memory access (NUMA) topology.
+ * Copyright (C) 2025-present  dbstream
+ *
+ * Architecture code describes the nodes of the machine during arch_init, after
+ * which numa_init computes, for every node, the order in which the page
+ * allocator should fall back to the other nodes.
+ */
+#include <davix/numa.h>
+#include <davix/printk.h>
+#include <string.h>
+#include <vsnprintf.h>
+
+int nr_nodes = 1;
+int cpu_to_node_array[CONFIG_MAX_NR_CPUS];
+int node_fallback_array[CONFIG_MAX_NR_NODES][CONFIG_MAX_NR_NODES];
+
+static unsigned int distance_table[CONFIG_MAX_NR_NODES][CONFIG_MAX_NR_NODES];
+
+/**
+ * The distances that ACPI uses when there is no better information: 10 for
+ * local memory and 20 for remote memory.
+ */
+static constexpr unsigned int local_distance = 10;
+static constexpr unsigned int remote_distance = 20;
+
+struct numa_memblk {
+	uintptr_t start;
+	uintptr_t end;
+	int node;
+};
+
+static constexpr int max_memblks = 64;
+
+static numa_memblk memblks[max_memblks];
+static int nr_memblks;
+
+/**
+ * numa_add_memory - add a range of physical memory to a node.
+ * @node: the node
+ * @start: first address of the range
+ * @end: last address of the range
+ */
+void
+numa_add_memory (int node, uintptr_t start, uintptr_t end)
+{
+	if (nr_memblks == max_memblks) {
+		printk (PR_WARN "numa: too many memory ranges, ignoring 0x%lx-0x%lx\n",
+				start, end);
+		return;
+	}
+
+	memblks[nr_memblks].start = start;
+	memblks[nr_memblks].end = end;
+	memblks[nr_memblks].node = node;
+	nr_memblks++;
+}
+
+void
+numa_set_cpu_node (unsigned int cpu, int node)
+{
+	cpu_to_node_array[cpu] = node;
+}
+
+void
+numa_set_distance (int from, int to, unsigned int distance)
+{
+	distance_table[from][to] = distance;
+}
+
+/**
+ * phys_to_node - get the node that a physical address belongs to.
+ * @phys: physical address
+ */
+int
+phys_to_node (uintptr_t phys)
+{
+	if (nr_nodes == 1)
+		return 0;
+
+	for (int i = 0; i < nr_memblks; i++)
+		if (memblks[i].start <= phys && phys <= memblks[i].end)
+			return memblks[i].node;
+
+	return 0;
+}
+
+/**
+ * node_distance - get the relative cost of accessing memory on another node.
+ * @from: node that performs the access
+ * @to: node that the memory belongs to
+ */
+unsigned int
+node_distance (int from, int to)
+{
+	return distance_table[from][to];
+}
+
+/**
+ * numa_init - finish setting up the NUMA topology.
+ * @nr: the number of nodes
+ */
+void
+numa_init (int nr)
+{
+	nr_nodes = nr;
+
+	for (int from = 0; from < nr; from++) {
+		for (int to = 0; to < nr; to++) {
+			if (!distance_table[from][to])
+				distance_table[from][to] = (from == to)
+					? local_distance : remote_distance;
+		}
+	}
+
+	/*
+	 * Sort the nodes by their distance, breaking ties by node number so
+	 * that every node comes first in its own fallback order.
+	 */
+	for (int node = 0; node < nr; node++) {
+		int *order = node_fallback_array[node];
+		order[0] = node;
+		for (int i = 1, other = 0; other < nr; other++) {
+			if (other == node)
+				continue;
+
+			int j = i++;
+			unsigned int d = distance_table[node][other];
+			for (; j > 1 && distance_table[node][order[j - 1]] > d; j--)
+				order[j] = order[j - 1];
+			order[j] = other;
+		}
+	}
+
+	if (nr == 1)
+		return;
+
+	printk (PR_INFO "numa: %d nodes\n", nr);
+	for (int node = 0; node < nr; node++) {
+		char buf[8 * CONFIG_MAX_NR_NODES];
+		buf[0] = 0;
+		for (int i = 0; i < nr; i++) {
+			size_t n = strlen (buf);
+			snprintf (buf + n, sizeof (buf) - n, " %u",
+					distance_table[node][i]);
+		}
+		printk (PR_INFO ".. node %d distances:%s\n", node, buf);
+	}
+
+	for (int i = 0; i < nr_memblks; i++)
+		printk (PR_INFO ".. node %d: 0x%lx-0x%lx\n", memblks[i].node,
+				memblks[i].start, memblks[i].end);
+}
@@ -1,97 +1,875 @@
 /**
  * Page allocation.
  * Copyright (C) 2025-present  dbstream
+ *
+ * This is a binary buddy allocator.  Every zone keeps one free list per block
+ * order, and every free block is naturally aligned to its own size.  The first
+ * page of a free block is marked with PAGE_BUDDY and records the block order.
+ *
+ * When a block is freed, we check whether its buddy (the block with which it
+ * forms a block of the next order) is free as well, and if so, we coalesce the
+ * two.  Blocks never coalesce across zone or node boundaries.
+ *
+ * NB: the architecture must ensure that the struct Page for every page in any
+ * (PAGE_SIZE << max_page_order)-aligned block that contains usable memory is
+ * mapped and zero-initialized, since we look at the buddy page when freeing.
+ *
+ * Every NUMA node has its own set of zones.  Allocations walk the zone fallback
+ * chain, and within each zone try the nodes in order of their distance from the
+ * preferred node.  Thus remote memory is preferred over a lower zone, which is
+ * scarce and needed by devices that cannot address all of memory.
+ *
+ * In front of the buddy lists sits a small per-CPU cache of order-0 pages for
+ * each zone, so that the common single-page alloc_page and free_page do not
+ * have to take freelist_lock at all.  See pcp_alloc and pcp_free.
+ *
+ * Every zone also has a pool of pages that were zeroed ahead of time by the idle
+ * task (see zero_idle_page), which serves order-0 __ALLOC_ZERO allocations so
+ * that they do not have to clear the page on the critical path.
+ *
+ * Every zone has three watermarks.  Ordinary allocations may not take the free
+ * page count of a zone below its min watermark; the pages below it are reserved
+ * for __ALLOC_HIGHPRIO callers such as page table allocation.  When the free
+ * page count drops below the low watermark, a DPC runs the registered shrinkers
+ * until every zone is back above its high watermark.  Pages that sit in the
+ * per-CPU caches or in the pre-zeroed pools do not count as free here.
  */
+#include <asm/percpu.h>
+#include <asm/smp.h>
 #include <asm/zone.h>
+#include <davix/atomic.h>
+#include <davix/dpc.h>
+#include <davix/irql.h>
+#include <davix/numa.h>
 #include <davix/page.h>
 #include <davix/printk.h>
 #include <davix/spinlock.h>
 #include <string.h>
+#include <vsnprintf.h>
 
 struct Zone {
-	PageList free_list;
+	PageList free_list[max_page_order + 1];
+	size_t nr_free[max_page_order + 1];
 	size_t count;
+
+	size_t wmark_min;
+	size_t wmark_low;
+	size_t wmark_high;
+
+	spinlock_t zero_lock;
+	PageList zero_list;
+	size_t nr_zero;
 };
 
-static Zone zone_list[num_page_zones];
+static Zone zone_list[CONFIG_MAX_NR_NODES][num_page_zones];
 static size_t total_free_pages;
 
 static spinlock_t freelist_lock;
 
+static spinlock_t shrinker_lock;
+static dsl::TypedList<Shrinker, &Shrinker::node> shrinker_list;
+
+static size_t
+shrink_zero_pools (Shrinker *shrinker, size_t nr_pages);
+
+static Shrinker zero_pool_shrinker;
+
+static bool reclaim_pending;
+static DEFINE_PERCPU(DPC, reclaim_dpc);
+
+static void
+reclaim_dpc_routine (DPC *dpc, void *arg1, void *arg2);
+
+PERCPU_CONSTRUCTOR(page_alloc_reclaim)
+{
+	percpu_ptr (reclaim_dpc).on (cpu)->init (reclaim_dpc_routine,
+			nullptr, nullptr);
+}
+
+/**
+ * Per-CPU page caches are refilled from and drained to the zone free lists in
+ * batches of pcp_batch pages, and never grow beyond pcp_high pages.  Freed
+ * (cache-hot) pages are added at the front of the list and handed out first,
+ * and draining returns the coldest pages at the back of the list.
+ */
+static constexpr unsigned int pcp_batch = 16;
+static constexpr unsigned int pcp_high = 4 * pcp_batch;
+
+struct pcp_list {
+	PageList list;
+	unsigned int count;
+};
+
+struct per_cpu_pages {
+	pcp_list zones[CONFIG_MAX_NR_NODES][num_page_zones];
+};
+
+static DEFINE_PERCPU(per_cpu_pages, pcp_pages);
+
+PERCPU_CONSTRUCTOR(page_alloc_pcp)
+{
+	per_cpu_pages *pcp = percpu_ptr (pcp_pages).on (cpu);
+	for (int node = 0; node < CONFIG_MAX_NR_NODES; node++) {
+		for (int i = 0; i < num_page_zones; i++) {
+			pcp->zones[node][i].list.init ();
+			pcp->zones[node][i].count = 0;
+		}
+	}
+}
+
 void
 pgalloc_init (void)
 {
-	for (int i = 0; i < num_page_zones; i++) {
-		zone_list[i].free_list.init ();
-		zone_list[i].count = 0;
+	for (int node = 0; node < CONFIG_MAX_NR_NODES; node++) {
+		for (int i = 0; i < num_page_zones; i++) {
+			Zone *z = &zone_list[node][i];
+			for (unsigned int order = 0; order <= max_page_order; order++) {
+				z->free_list[order].init ();
+				z->nr_free[order] = 0;
+			}
+			z->count = 0;
+			z->wmark_min = 0;
+			z->wmark_low = 0;
+			z->wmark_high = 0;
+			z->zero_lock.init ();
+			z->zero_list.init ();
+			z->nr_zero = 0;
+		}
 	}
+
+	shrinker_lock.init ();
+	shrinker_list.init ();
+
+	zero_pool_shrinker.shrink = shrink_zero_pools;
+	register_shrinker (&zero_pool_shrinker);
 }
 
-static inline int
+static inline Zone *
 page_zone (Page *page)
 {
-	return phys_to_zone (page_to_phys (page));
+	return &zone_list[page->nid][phys_to_zone (page_to_phys (page))];
 }
 
 void
 dump_pgalloc_stats (void)
 {
 	size_t nfree;
-	size_t zone_nfree[num_page_zones];
+	size_t zone_nfree[CONFIG_MAX_NR_NODES][num_page_zones];
+	size_t zone_nzero[CONFIG_MAX_NR_NODES][num_page_zones];
+	size_t zone_wmark[CONFIG_MAX_NR_NODES][num_page_zones][3];
+	size_t zone_blocks[CONFIG_MAX_NR_NODES][num_page_zones][max_page_order + 1];
 
 	{
 		scoped_spinlock_dpc g (freelist_lock);
 		nfree = total_free_pages;
-		for (int i = 0; i < num_page_zones; i++)
-			zone_nfree[i] = zone_list[i].count;
+		for (int node = 0; node < nr_nodes; node++) {
+			for (int i = 0; i < num_page_zones; i++) {
+				Zone *z = &zone_list[node][i];
+				zone_nfree[node][i] = z->count;
+				zone_wmark[node][i][0] = z->wmark_min;
+				zone_wmark[node][i][1] = z->wmark_low;
+				zone_wmark[node][i][2] = z->wmark_high;
+				for (unsigned int order = 0; order <= max_page_order; order++)
+					zone_blocks[node][i][order] = z->nr_free[order];
+			}
+		}
 	}
 
+	for (int node = 0; node < nr_nodes; node++)
+		for (int i = 0; i < num_page_zones; i++)
+			zone_nzero[node][i] = atomic_load_relaxed (&zone_list[node][i].nr_zero);
+
 	printk (PR_NOTICE "page_alloc:  %zu pages  (%zu MiB)  free\n",
 			nfree, (nfree * PAGE_SIZE) / 1048576);
-	for (int i = 0; i < num_page_zones; i++) {
-		printk (PR_NOTICE ".. zone %d:  %zu pages  (%zu KiB)\n",
-				i, zone_nfree[i],
-				(zone_nfree[i] * PAGE_SIZE) / 1024);
+	for (int node = 0; node < nr_nodes; node++) {
+		for (int i = 0; i < num_page_zones; i++) {
+			printk (PR_NOTICE ".. node %d zone %d:  %zu pages  (%zu KiB)  %zu pre-zeroed\n",
+					node, i, zone_nfree[node][i],
+					(zone_nfree[node][i] * PAGE_SIZE) / 1024,
+					zone_nzero[node][i]);
+			printk (PR_INFO "..   watermarks:  min %zu  low %zu  high %zu\n",
+					zone_wmark[node][i][0], zone_wmark[node][i][1],
+					zone_wmark[node][i][2]);
+
+			char buf[16 * (max_page_order + 1)];
+			buf[0] = 0;
+			for (unsigned int order = 0; order <= max_page_order; order++) {
+				size_t n = strlen (buf);
+				snprintf (buf + n, sizeof (buf) - n, " %zu",
+						zone_blocks[node][i][order]);
+			}
+			printk (PR_INFO "..   free blocks by order:%s\n", buf);
+		}
 	}
 }
 
-Page *
-alloc_page (allocation_class aclass)
+static inline void
+add_to_free_list (Zone *z, Page *page, unsigned int order)
 {
-	Page *page;
-	int zone = allocation_zone (aclass);
+	page->flags = PAGE_BUDDY;
+	page->buddy.order = order;
+	z->free_list[order].push_front (page);
+	z->nr_free[order]++;
+}
+
+static inline void
+del_from_free_list (Zone *z, Page *page, unsigned int order)
+{
+	page->node.remove ();
+	page->flags = 0;
+	z->nr_free[order]--;
+}
+
+/**
+ * page_is_buddy - test if a page is the head of a free block we can merge with.
+ * @buddy: the page to test
+ * @order: order of the block we want to merge
+ * @z: zone of the block we want to merge
+ */
+static inline bool
+page_is_buddy (Page *buddy, unsigned int order, Zone *z)
+{
+	if (!(buddy->flags & PAGE_BUDDY) || buddy->buddy.order != order)
+		return false;
+
+	return page_zone (buddy) == z;
+}
+
+/**
+ * rmqueue - take a block of the given order from a zone.
+ * @z: zone to allocate from
+ * @order: order of the block
+ * Returns the first page of the block or NULL if the zone had no large enough
+ * free block.  This function must be called with freelist_lock held.
+ */
+static Page *
+rmqueue (Zone *z, unsigned int order)
+{
+	for (unsigned int o = order; o <= max_page_order; o++) {
+		if (z->free_list[o].empty ())
+			continue;
+
+		Page *page = z->free_list[o].pop_front ();
+		page->flags = 0;
+		z->nr_free[o]--;
+
+		/*
+		 * Split the block, returning the upper halves to the free
+		 * lists until we are left with a block of the right size.
+		 */
+		while (o > order) {
+			o--;
+			add_to_free_list (z, page + (1UL << o), o);
+		}
+
+		z->count -= 1UL << order;
+		total_free_pages -= 1UL << order;
+		return page;
+	}
+
+	return nullptr;
+}
+
+/**
+ * free_one - return a block to its zone, coalescing it with free buddies.
+ * @page: first page of the block
+ * @order: order of the block
+ * This function must be called with freelist_lock held.
+ */
+static void
+free_one (Page *page, unsigned int order)
+{
+	Zone *z = page_zone (page);
+	pfn_t pfn = page_to_pfn (page);
+
+	z->count += 1UL << order;
+	total_free_pages += 1UL << order;
+
+	while (order < max_page_order) {
+		Page *buddy = pfn_to_page (pfn ^ (1UL << order));
+		if (!page_is_buddy (buddy, order, z))
+			break;
+
+		del_from_free_list (z, buddy, order);
+		pfn &= ~(1UL << order);
+		order++;
+	}
 
+	add_to_free_list (z, pfn_to_page (pfn), order);
+}
+
+/**
+ * wake_reclaim - schedule the shrinkers to run.
+ * This function must be called with DPCs disabled.
+ */
+static void
+wake_reclaim (void)
+{
+	if (atomic_load_relaxed (&reclaim_pending))
+		return;
+	if (atomic_exchange_acquire (&reclaim_pending, true))
+		return;
+
+	DPC *dpc = percpu_ptr (reclaim_dpc);
+	dpc->enqueue ();
+}
+
+/**
+ * rmqueue_wmark - take a block of the given order from a zone, respecting the
+ * zone's min watermark.
+ * @z: zone to allocate from
+ * @order: order of the block
+ * @aclass: allocation class
+ * Returns the first page of the block or NULL if the zone had no large enough
+ * free block or is too low on memory.  This function must be called with
+ * freelist_lock held.
+ */
+static Page *
+rmqueue_wmark (Zone *z, unsigned int order, allocation_class aclass)
+{
+	Page *page = nullptr;
+
+	size_t reserve = (aclass & __ALLOC_HIGHPRIO) ? 0 : z->wmark_min;
+	if (z->count >= reserve + (1UL << order))
+		page = rmqueue (z, order);
+
+	if (z->count < z->wmark_low) [[unlikely]]
+		wake_reclaim ();
+
+	return page;
+}
+
+/**
+ * The order in which allocations try the zones of the machine; see the comment
+ * at the top of this file.
+ */
+struct zone_iter {
+	int pref_node;
+	int zone;
+	int i;
+
+	zone_iter (int node, allocation_class aclass)
+		: pref_node (node), zone (allocation_zone (aclass)), i (0)
+	{}
+
+	inline int
+	node (void) const
 	{
+		return node_fallback (pref_node, i);
+	}
+
+	inline Zone *
+	get (void) const
+	{
+		return &zone_list[node ()][zone];
+	}
+
+	/**
+	 * Advance to the next zone.  Returns false if there are no zones
+	 * left to try.
+	 */
+	inline bool
+	next (void)
+	{
+		if (++i < nr_nodes)
+			return true;
+
+		i = 0;
+		if (!zone_has_fallback (zone))
+			return false;
+
+		zone = fallback_zone (zone);
+		return true;
+	}
+};
+
+/**
+ * pcp_alloc - allocate an order-0 page from the per-CPU cache of a zone.
+ * @node: node to allocate from
+ * @zone: zone to allocate from
+ * @aclass: allocation class
+ * Returns NULL if both the per-CPU cache and the zone are empty.  This function
+ * must be called with DPCs disabled.
+ */
+static Page *
+pcp_alloc (int node, int zone, allocation_class aclass)
+{
+	per_cpu_pages *pages = percpu_ptr (pcp_pages);
+	pcp_list *pcp = &pages->zones[node][zone];
+
+	if (!pcp->count) {
+		Zone *z = &zone_list[node][zone];
 		scoped_spinlock_dpc g (freelist_lock);
 
+		/*
+		 * The batch serves whoever allocates next on this CPU, so
+		 * refill it only with pages above the normal watermark.  A
+		 * HIGHPRIO allocation may take a single page below it.
+		 */
+		for (; pcp->count < pcp_batch; pcp->count++) {
+			Page *page = rmqueue_wmark (z, 0,
+					aclass & ~__ALLOC_HIGHPRIO);
+			if (!page)
+				break;
+			pcp->list.push_back (page);
+		}
+
+		if (!pcp->count)
+			return (aclass & __ALLOC_HIGHPRIO)
+				? rmqueue_wmark (z, 0, aclass) : nullptr;
+	}
+
+	pcp->count--;
+	return pcp->list.pop_front ();
+}
+
+/**
+ * pcp_free - free an order-0 page to the per-CPU cache of its zone.
+ * @page: page to free
+ * This function must be called with DPCs disabled.
+ */
+static void
+pcp_free (Page *page)
+{
+	per_cpu_pages *pages = percpu_ptr (pcp_pages);
+	pcp_list *pcp = &pages->zones[page->nid][phys_to_zone (page_to_phys (page))];
+
+	pcp->list.push_front (page);
+	if (++pcp->count <= pcp_high) [[likely]]
+		return;
+
+	scoped_spinlock_dpc g (freelist_lock);
+	for (unsigned int i = 0; i < pcp_batch; i++)
+		free_one (pcp->list.pop_back (), 0);
+	pcp->count -= pcp_batch;
+}
+
+/**
+ * drain_local_pages - return all pages in this CPU's page caches to the zones.
+ * This function must be called with freelist_lock held.
+ */
+static void
+drain_local_pages (void)
+{
+	per_cpu_pages *pcp = percpu_ptr (pcp_pages);
+	for (int node = 0; node < nr_nodes; node++) {
+		for (int i = 0; i < num_page_zones; i++) {
+			pcp_list *l = &pcp->zones[node][i];
+			while (l->count) {
+				free_one (l->list.pop_front (), 0);
+				l->count--;
+			}
+		}
+	}
+}
+
+/**
+ * zero_pool_target - get the number of pre-zeroed pages to keep in a zone.
+ * @zone: index of the zone
+ */
+static constexpr size_t
+zero_pool_target (int zone)
+{
+	/* The lowest zone is too scarce to keep pages around in.  */
+	return zone_has_fallback (zone) ? 128 : 0;
+}
+
+/**
+ * zero_pool_take - take a page from the pre-zeroed pool of a zone.
+ * @z: zone to allocate from
+ * Returns NULL if the pool is empty.
+ */
+static Page *
+zero_pool_take (Zone *z)
+{
+	if (!atomic_load_relaxed (&z->nr_zero))
+		return nullptr;
+
+	scoped_spinlock_dpc g (z->zero_lock);
+	if (z->zero_list.empty ())
+		return nullptr;
+
+	atomic_store_relaxed (&z->nr_zero, z->nr_zero - 1);
+	return z->zero_list.pop_front ();
+}
+
+/**
+ * drain_zero_pools - return all pre-zeroed pages to the zones.
+ * This function must be called with freelist_lock held.
+ */
+static void
+drain_zero_pools (void)
+{
+	for (int node = 0; node < nr_nodes; node++) {
+		for (int i = 0; i < num_page_zones; i++) {
+			Zone *z = &zone_list[node][i];
+			z->zero_lock.raw_lock ();
+			while (!z->zero_list.empty ())
+				free_one (z->zero_list.pop_front (), 0);
+			atomic_store_relaxed (&z->nr_zero, 0);
+			z->zero_lock.raw_unlock ();
+		}
+	}
+}
+
+/**
+ * zero_idle_page - zero one page for the pre-zeroed page pool.
+ * Returns true if a page was zeroed, or false if there is nothing to do.
+ *
+ * This is called by the idle task whenever it has nothing better to do.  The
+ * page is zeroed with DPCs enabled, so the idle task can be preempted at any
+ * time.  Pools of the local node are filled first.
+ */
+bool
+zero_idle_page (void)
+{
+	zone_iter it (cpu_to_node (this_cpu_id ()), ALLOC_KERNEL);
+	do {
+		Zone *z = it.get ();
+		if (atomic_load_relaxed (&z->nr_zero) >= zero_pool_target (it.zone))
+			continue;
+
+		Page *page = nullptr;
+		{
+			/*
+			 * Do not fill the pool from a zone that is already short
+			 * on memory; the shrinker would only drain it again.
+			 */
+			scoped_spinlock_dpc g (freelist_lock);
+			if (z->count > z->wmark_high)
+				page = rmqueue (z, 0);
+		}
+
+		if (!page)
+			continue;
+
+		memset ((void *) page_to_virt (page), 0, PAGE_SIZE);
+
+		scoped_spinlock_dpc g (z->zero_lock);
+		z->zero_list.push_back (page);
+		atomic_store_relaxed (&z->nr_zero, z->nr_zero + 1);
+		return true;
+	} while (it.next ());
+
+	return false;
+}
+
+/**
+ * alloc_pages_node - allocate a naturally-aligned block of physical pages,
+ * preferably from a given node.
+ * @node: the preferred node
+ * @order: the block contains 2^order pages
+ * @aclass: allocation class
+ * Returns the first page of the block or NULL on failure.
+ */
+Page *
+alloc_pages_node (int node, unsigned int order, allocation_class aclass)
+{
+	if (order > max_page_order) [[unlikely]]
+		return nullptr;
+
+	Page *page;
+
+	if (!order) {
+		scoped_dpc g;
+
+		/*
+		 * Only the pool of the zone that we are trying is used, so that
+		 * a zeroed allocation does not take pre-zeroed pages from a
+		 * remote node or a lower zone when it could zero a page from
+		 * the preferred zone inline.
+		 */
+		zone_iter it (node, aclass);
 		for (;;) {
-			if (!zone_list[zone].free_list.empty ()) [[likely]] {
-				page = zone_list[zone].free_list.pop_front ();
-				zone_list[zone].count--;
-				total_free_pages--;
+			if (aclass & __ALLOC_ZERO) {
+				page = zero_pool_take (it.get ());
+				if (page)
+					return page;
+			}
+
+			page = pcp_alloc (it.node (), it.zone, aclass);
+			if (page) [[likely]]
 				break;
+
+			/*
+			 * Pre-zeroed pages are still free memory: use them
+			 * rather than failing the allocation.
+			 */
+			if (!(aclass & __ALLOC_ZERO)) {
+				page = zero_pool_take (it.get ());
+				if (page)
+					return page;
 			}
-			if (!zone_has_fallback (zone))
+
+			if (!it.next ())
 				return nullptr; // womp womp
-			zone = fallback_zone (zone);
+		}
+	} else {
+		bool drained = false;
+		scoped_spinlock_dpc g (freelist_lock);
+
+		zone_iter it (node, aclass);
+		for (;;) {
+			page = rmqueue_wmark (it.get (), order, aclass);
+			if (page) [[likely]]
+				break;
+			if (it.next ())
+				continue;
+
+			/*
+			 * Pages sitting in our per-CPU caches or in the
+			 * pre-zeroed pools may be all that keeps a larger block
+			 * from coalescing.
+			 */
+			if (drained)
+				return nullptr;
+			drain_local_pages ();
+			drain_zero_pools ();
+			drained = true;
+			it = zone_iter (node, aclass);
 		}
 	}
 
 	if (aclass & __ALLOC_ZERO)
-		memset ((void *) page_to_virt (page), 0, PAGE_SIZE);
+		memset ((void *) page_to_virt (page), 0, PAGE_SIZE << order);
 
 	return page;
 }
 
+/**
+ * alloc_pages - allocate a naturally-aligned block of physical pages.
+ * @order: the block contains 2^order pages
+ * @aclass: allocation class
+ * Returns the first page of the block or NULL on failure.
+ *
+ * Memory is preferably allocated from the node of the current CPU.
+ */
+Page *
+alloc_pages (unsigned int order, allocation_class aclass)
+{
+	return alloc_pages_node (cpu_to_node (this_cpu_id ()), order, aclass);
+}
+
+/**
+ * free_pages - free a block of physical pages.
+ * @page: first page of the block
+ * @order: the order that was passed to alloc_pages
+ */
 void
-free_page (Page *page)
+free_pages (Page *page, unsigned int order)
 {
 	page->flags = 0;
-	int zone = page_zone (page);
+
+	if (!order) {
+		scoped_dpc g;
+		pcp_free (page);
+		return;
+	}
+
+	scoped_spinlock_dpc g (freelist_lock);
+	free_one (page, order);
+}
+
+/**
+ * alloc_pages_bulk - allocate many order-0 pages at once.
+ * @aclass: allocation class
+ * @n: number of pages to allocate
+ * @list: list to which the allocated pages are appended
+ * Returns true on success.  On failure, no pages are allocated and @list is left
+ * unchanged.
+ *
+ * All pages are taken from the zone free lists under a single acquisition of
+ * freelist_lock.
+ */
+bool
+alloc_pages_bulk (allocation_class aclass, size_t n, PageList *list)
+{
+	PageList pages;
+	zone_iter it (cpu_to_node (this_cpu_id ()), aclass);
+
+	{
+		scoped_spinlock_dpc g (freelist_lock);
+
+		for (size_t i = 0; i < n; i++) {
+			Page *page;
+			for (;;) {
+				page = rmqueue_wmark (it.get (), 0, aclass);
+				if (page) [[likely]]
+					break;
+				if (it.next ())
+					continue;
+
+				while (!pages.empty ())
+					free_one (pages.pop_front (), 0);
+				return false;
+			}
+
+			pages.push_back (page);
+		}
+	}
+
+	if (aclass & __ALLOC_ZERO) {
+		for (Page *page : pages)
+			memset ((void *) page_to_virt (page), 0, PAGE_SIZE);
+	}
+
+	while (!pages.empty ())
+		list->push_back (pages.pop_front ());
+	return true;
+}
+
+/**
+ * free_pages_bulk - free a list of order-0 pages at once.
+ * @list: list of pages to free; it is empty on return
+ *
+ * All pages are returned to the zone free lists under a single acquisition of
+ * freelist_lock.
+ */
+void
+free_pages_bulk (PageList *list)
+{
+	scoped_spinlock_dpc g (freelist_lock);
+	while (!list->empty ()) {
+		Page *page = list->pop_front ();
+		page->flags = 0;
+		free_one (page, 0);
+	}
+}
+
+/**
+ * register_shrinker - register a cache that can give back pages under memory
+ * pressure.
+ * @shrinker: the shrinker to register
+ */
+void
+register_shrinker (Shrinker *shrinker)
+{
+	scoped_spinlock_dpc g (shrinker_lock);
+	shrinker_list.push_back (shrinker);
+}
+
+/**
+ * unregister_shrinker - unregister a shrinker.
+ * @shrinker: the shrinker to unregister
+ * On return, the shrinker is not running on any CPU.
+ */
+void
+unregister_shrinker (Shrinker *shrinker)
+{
+	scoped_spinlock_dpc g (shrinker_lock);
+	shrinker->node.remove ();
+}
+
+/**
+ * reclaim_target - get the number of pages needed to bring every zone back
+ * above its high watermark.
+ */
+static size_t
+reclaim_target (void)
+{
+	size_t target = 0;
 
 	scoped_spinlock_dpc g (freelist_lock);
+	for (int node = 0; node < nr_nodes; node++) {
+		for (int i = 0; i < num_page_zones; i++) {
+			Zone *z = &zone_list[node][i];
+			if (z->count < z->wmark_high)
+				target += z->wmark_high - z->count;
+		}
+	}
+
+	return target;
+}
 
-	zone_list[zone].free_list.push_front (page);
-	zone_list[zone].count++;
-	total_free_pages++;
+/**
+ * reclaim_dpc_routine - run the shrinkers after a zone dropped below its low
+ * watermark.
+ *
+ * The shrinkers run from a DPC rather than from the allocation that noticed the
+ * shortage, because allocations are made with all sorts of locks held, for
+ * example those of the slab caches that we want to shrink.
+ */
+static void
+reclaim_dpc_routine (DPC *dpc, void *arg1, void *arg2)
+{
+	(void) dpc;
+	(void) arg1;
+	(void) arg2;
+
+	{
+		scoped_spinlock_dpc g (freelist_lock);
+		drain_local_pages ();
+	}
+
+	size_t target = reclaim_target ();
+	if (target) {
+		scoped_spinlock_dpc g (shrinker_lock);
+		for (Shrinker *shrinker : shrinker_list) {
+			size_t n = shrinker->shrink (shrinker, target);
+			if (n >= target)
+				break;
+			target -= n;
+		}
+	}
+
+	atomic_store_release (&reclaim_pending, false);
+}
+
+/**
+ * shrink_zero_pools - give pre-zeroed pages back to the zones.
+ */
+static size_t
+shrink_zero_pools (Shrinker *shrinker, size_t nr_pages)
+{
+	(void) shrinker;
+
+	size_t n = 0;
+	scoped_spinlock_dpc g (freelist_lock);
+	for (int node = 0; node < nr_nodes; node++) {
+		for (int i = 0; i < num_page_zones && n < nr_pages; i++) {
+			Zone *z = &zone_list[node][i];
+			z->zero_lock.raw_lock ();
+			for (; n < nr_pages && !z->zero_list.empty (); n++) {
+				free_one (z->zero_list.pop_front (), 0);
+				atomic_store_relaxed (&z->nr_zero, z->nr_zero - 1);
+			}
+			z->zero_lock.raw_unlock ();
+		}
+	}
+
+	return n;
+}
+
+/**
+ * pgalloc_init_watermarks - calculate the watermarks of every zone.
+ *
+ * This is called whenever a large amount of memory has been freed to the page
+ * allocator for the first time.  Until the first call, the watermarks are zero
+ * and allocations are never held back.
+ */
+void
+pgalloc_init_watermarks (void)
+{
+	scoped_spinlock_dpc g (freelist_lock);
+	for (int node = 0; node < nr_nodes; node++) {
+		for (int i = 0; i < num_page_zones; i++) {
+			Zone *z = &zone_list[node][i];
+
+			/*
+			 * Reserve 1/256th of the zone, within reasonable bounds,
+			 * but never so much that small zones become unusable.
+			 */
+			size_t min = z->count / 256;
+			if (min < 32)
+				min = 32;
+			if (min > 8192)
+				min = 8192;
+			if (min > z->count / 4)
+				min = z->count / 4;
+
+			z->wmark_min = min;
+			z->wmark_low = min + min / 4;
+			z->wmark_high = min + min / 2;
+		}
+	}
 }
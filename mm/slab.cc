@@ -1,14 +1,61 @@
 /**
  * Slab allocator.
  * Copyright (C) 2025-present  dbstream
+ *
+ * In front of the slab pages of most caches sits a per-CPU magazine layer, in
+ * the style of Bonwick's "Magazines and Vmem".  A magazine is an array of up to
+ * magazine_size free objects.  Every CPU has a loaded and a previous magazine
+ * for every cache, and allocates from and frees to those with nothing but DPCs
+ * disabled.  Only when both are empty (or full) does it exchange a magazine
+ * with the cache's depot of full and empty magazines, under the cache lock.
+ *
+ * A slab is a block of 2^slab_order pages.  Caches of large objects use slabs of
+ * more than one page, so that less of each slab is lost to rounding.  The tail
+ * pages of such a slab are marked PAGE_TAIL and point back to the first page,
+ * which holds the slab metadata.
+ *
+ * Slabs whose objects are all free are not given back to the page allocator
+ * right away.  Every cache keeps up to empty_reserve of them indefinitely, and
+ * any surplus beyond that decays by half every slab_reap_interval, driven by a
+ * KTimer that is only armed while some cache has a surplus.  When memory runs
+ * low, slab_shrinker also gives back the surplus, the reserves and the objects
+ * cached in the depots.
+ *
+ * A CPU that finds the lock of a cache taken when it frees an object does not
+ * wait for it.  Instead it pushes the object onto the remote_free list of its
+ * slab with a compare-and-swap, and the first such object also pushes the slab
+ * onto the remote_pages list of the cache.  Whoever next runs out of slabs to
+ * allocate from while holding the lock takes both lists in one exchange each
+ * and frees the objects properly.
+ *
+ * Free objects are threaded onto the free list of their slab through a pointer
+ * at free_offset into the object.  This is normally zero, but caches with a
+ * constructor or with SLAB_TYPESAFE_RCU must keep the contents of free objects
+ * intact, so they place the pointer after the object.
+ *
+ * The space left over at the end of a slab is used for cache coloring: the
+ * objects of successive slabs start at successive multiples of color_step into
+ * the slab, so that the first objects of different slabs do not all compete
+ * for the same cache sets.
  */
+#include <asm/cache.h>
+#include <asm/percpu.h>
+#include <asm/smp.h>
+#include <davix/cpuset.h>
+#include <davix/atomic.h>
+#include <davix/irql.h>
 #include <davix/kmalloc.h>
+#include <davix/ktimer.h>
 #include <davix/page.h>
 #include <davix/panic.h>
 #include <davix/printk.h>
+#include <davix/rcu.h>
 #include <davix/slab.h>
 #include <davix/spinlock.h>
+#include <davix/vmap.h>
+#include <container_of.h>
 #include <dsl/align.h>
+#include <dsl/minmax.h>
 #include <string.h>
 #include <vsnprintf.h>
 #include <new>
@@ -20,6 +67,38 @@ ptr_is_slab (const void *ptr)
 	return (page->flags & PAGE_SLAB) == PAGE_SLAB;
 }
 
+static constexpr unsigned int magazine_size = 16;
+
+struct Magazine {
+	dsl::ListHead node;
+	unsigned int rounds;
+	void *objs[magazine_size];
+};
+
+typedef dsl::TypedList<Magazine, &Magazine::node> MagazineList;
+
+/**
+ * Per-CPU event counters of a cache.  Every counter is only written by its own
+ * CPU with DPCs disabled, and can be read from any CPU at any time.
+ */
+struct slab_cpu_stats {
+	unsigned long allocs;
+	unsigned long frees;
+	unsigned long fast_allocs;
+	unsigned long fast_frees;
+	unsigned long refills;
+	unsigned long drains;
+	unsigned long slabs_grabbed;
+	unsigned long slabs_released;
+	unsigned long remote_frees;
+};
+
+struct alignas(CACHELINE_SIZE) slab_cpu_cache {
+	Magazine *loaded;
+	Magazine *previous;
+	slab_cpu_stats stats;
+};
+
 struct SlabAllocator {
 	spinlock_t lock;
 	size_t nr_full;
@@ -32,145 +111,938 @@ struct SlabAllocator {
 	size_t inp_obj_size;
 	size_t inp_obj_align;
 	size_t real_obj_size;
-	size_t objs_per_page;
+	size_t objs_per_slab;
+	unsigned int slab_order;
+	size_t free_offset;
+	size_t color_step;
+	size_t color_max;
+	size_t color_next;
+	slab_flags_t flags;
+	void (*ctor) (void *);
+	size_t empty_reserve;
 	dsl::ListHead listHead;
 	char name[32];
+
+	/**
+	 * Per-CPU magazines, indexed by CPU number, or NULL if this cache
+	 * does not use magazines.  The depot is protected by lock.
+	 */
+	slab_cpu_cache *cpu_caches;
+	MagazineList depot_full;
+	MagazineList depot_empty;
+	size_t nr_depot_full;
+	size_t nr_depot_empty;
+
+	/** Slabs with objects on their remote_free list.  */
+	Page *remote_pages;
+
+	/** Most objects ever taken from the slabs at once.  */
+	size_t peak_inuse;
 };
 
+static SlabAllocator slab_allocator;
+static SlabAllocator magazine_allocator;
+
+static inline void **
+free_ptr (SlabAllocator *allocator, void *obj)
+{
+	return (void **) ((uintptr_t) obj + allocator->free_offset);
+}
+
+static constexpr size_t slab_default_reserve = 1;
+static constexpr nsecs_t slab_reap_interval = 1000000000 /* 1s */;
+
+static KTimer slab_reap_timer;
+static bool slab_reap_armed;
+
+/**
+ * arm_slab_reap - make sure that the reap timer will run.
+ */
+static void
+arm_slab_reap (void)
+{
+	if (atomic_load_relaxed (&slab_reap_armed))
+		return;
+
+	if (!atomic_exchange_acquire (&slab_reap_armed, true))
+		slab_reap_timer.enqueue (ns_since_boot () + slab_reap_interval);
+}
+
+/**
+ * count_event - bump a statistics counter of this CPU.
+ * @allocator: the cache
+ * @counter: the counter
+ * @n: the amount to add
+ *
+ * This function must be called with DPCs disabled.
+ */
+static inline void
+count_event (SlabAllocator *allocator,
+		unsigned long slab_cpu_stats::*counter, unsigned long n = 1)
+{
+	if (!allocator->cpu_caches)
+		return;
+
+	unsigned long *p = &(allocator->cpu_caches[this_cpu_id ()].stats.*counter);
+	atomic_store_relaxed (p, *p + n);
+}
+
+/**
+ * update_peak - record the number of objects taken from the slabs.
+ *
+ * This function must be called with allocator->lock held.
+ */
+static inline void
+update_peak (SlabAllocator *allocator)
+{
+	size_t nr_slabs = allocator->nr_full + allocator->nr_partial
+		+ allocator->nr_empty;
+	size_t inuse = nr_slabs * allocator->objs_per_slab - allocator->nfree;
+	if (inuse > allocator->peak_inuse)
+		atomic_store_relaxed (&allocator->peak_inuse, inuse);
+}
+
+static inline bool
+magazine_has_rounds (Magazine *mag)
+{
+	return mag && mag->rounds;
+}
+
+static inline bool
+magazine_has_space (Magazine *mag)
+{
+	return mag && mag->rounds < magazine_size;
+}
+
+/**
+ * magazine_alloc - allocate an object from this CPU's magazines.
+ * @allocator: the cache
+ * Returns NULL if neither this CPU nor the depot has a magazine with objects.
+ */
+static void *
+magazine_alloc (SlabAllocator *allocator)
+{
+	scoped_dpc g;
+	slab_cpu_cache *cc = &allocator->cpu_caches[this_cpu_id ()];
+
+	if (!magazine_has_rounds (cc->loaded)) [[unlikely]] {
+		Magazine *tmp = cc->loaded;
+		if (magazine_has_rounds (cc->previous)) {
+			cc->loaded = cc->previous;
+			cc->previous = tmp;
+		} else {
+			scoped_spinlock_dpc g (allocator->lock);
+			if (allocator->depot_full.empty ())
+				return nullptr;
+
+			if (cc->previous) {
+				allocator->depot_empty.push_front (cc->previous);
+				allocator->nr_depot_empty++;
+			}
+
+			cc->previous = tmp;
+			cc->loaded = allocator->depot_full.pop_front ();
+			allocator->nr_depot_full--;
+			count_event (allocator, &slab_cpu_stats::refills);
+		}
+	}
+
+	count_event (allocator, &slab_cpu_stats::allocs);
+	count_event (allocator, &slab_cpu_stats::fast_allocs);
+	return cc->loaded->objs[--cc->loaded->rounds];
+}
+
+/**
+ * magazine_free - free an object to this CPU's magazines.
+ * @allocator: the cache
+ * @ptr: the object
+ * Returns false if no empty magazine could be found for the object.
+ */
+static bool
+magazine_free (SlabAllocator *allocator, void *ptr)
+{
+	scoped_dpc g;
+	slab_cpu_cache *cc = &allocator->cpu_caches[this_cpu_id ()];
+
+	if (!magazine_has_space (cc->loaded)) [[unlikely]] {
+		Magazine *tmp = cc->loaded;
+		if (magazine_has_space (cc->previous)) {
+			cc->loaded = cc->previous;
+			cc->previous = tmp;
+		} else {
+			Magazine *empty = nullptr;
+			{
+				scoped_spinlock_dpc g (allocator->lock);
+				if (!allocator->depot_empty.empty ()) {
+					empty = allocator->depot_empty.pop_front ();
+					allocator->nr_depot_empty--;
+				}
+			}
+
+			if (!empty) {
+				empty = (Magazine *) slab_alloc (&magazine_allocator,
+						ALLOC_KERNEL);
+				if (!empty)
+					return false;
+				empty->rounds = 0;
+			}
+
+			if (cc->previous) {
+				scoped_spinlock_dpc g (allocator->lock);
+				allocator->depot_full.push_front (cc->previous);
+				allocator->nr_depot_full++;
+			}
+
+			cc->previous = tmp;
+			cc->loaded = empty;
+			count_event (allocator, &slab_cpu_stats::drains);
+		}
+	}
+
+	count_event (allocator, &slab_cpu_stats::frees);
+	count_event (allocator, &slab_cpu_stats::fast_frees);
+	cc->loaded->objs[cc->loaded->rounds++] = ptr;
+	return true;
+}
+
 static void *
 wrap (SlabAllocator *allocator, allocation_class aclass, void *ptr)
 {
+	if (allocator->ctor)
+		return ptr;
+
 	ptr = new (ptr) unsigned char [allocator->inp_obj_size];
 	if (aclass & __ALLOC_ZERO)
 		memset (ptr, 0, allocator->inp_obj_size);
 	return ptr;
 }
 
-void *
-slab_alloc (SlabAllocator *allocator, allocation_class aclass)
+static void
+free_to_slab (SlabAllocator *allocator, Page *page, void *ptr);
+
+/**
+ * remote_free - free an object without taking the lock of its cache.
+ * @allocator: the cache
+ * @page: head page of the slab that the object belongs to
+ * @ptr: the object
+ */
+static void
+remote_free (SlabAllocator *allocator, Page *page, void *ptr)
 {
-	aclass = ALLOC_KERNEL | (aclass & (__ALLOC_HIGHPRIO | __ALLOC_ZERO));
+	void *old = atomic_load_relaxed (&page->slab.remote_free);
+	do
+		*free_ptr (allocator, ptr) = old;
+	while (!atomic_cmpxchg_weak (&page->slab.remote_free, &old, ptr,
+			mo_release, mo_relaxed));
 
-	scoped_spinlock_dpc g (allocator->lock);
+	if (old)
+		/* The slab is already on remote_pages.  */
+		return;
 
-	Page *page = nullptr;
-	if (allocator->nr_partial) {
-		page = allocator->page_partial.pop_front ();
-		allocator->nr_partial--;
-	} else if (allocator->nr_full) {
-		page = allocator->page_full.pop_front ();
-		allocator->nr_full--;
+	Page *head = atomic_load_relaxed (&allocator->remote_pages);
+	do
+		page->slab.remote_next = head;
+	while (!atomic_cmpxchg_weak (&allocator->remote_pages, &head, page,
+			mo_release, mo_relaxed));
+}
+
+/**
+ * drain_remote_frees - free the objects on the remote_free lists of a cache.
+ * @allocator: the cache
+ * Returns true if any objects were freed.  This function must be called with
+ * allocator->lock held.
+ */
+static bool
+drain_remote_frees (SlabAllocator *allocator)
+{
+	if (!atomic_load_relaxed (&allocator->remote_pages))
+		return false;
+
+	Page *page = atomic_exchange_acquire (&allocator->remote_pages, nullptr);
+	if (!page)
+		return false;
+
+	while (page) {
+		/*
+		 * Once remote_free is emptied, the slab can be pushed onto
+		 * remote_pages again, so read remote_next first.
+		 */
+		Page *next = page->slab.remote_next;
+		void *obj = atomic_exchange_acq_rel (&page->slab.remote_free,
+				nullptr);
+		while (obj) {
+			void *obj_next = *free_ptr (allocator, obj);
+			free_to_slab (allocator, page, obj);
+			obj = obj_next;
+		}
+
+		page = next;
 	}
 
-	if (page) {
-		void *obj = page->slab.pobj;
-		page->slab.pobj = *(void **) obj;
-		if (!--(page->slab.nfree))
+	return true;
+}
+
+/**
+ * take_from_slabs - take free objects from the slabs of a cache.
+ * @allocator: the cache
+ * @objs: array that receives the objects
+ * @n: the maximum number of objects to take
+ * Returns the number of objects taken.  This function must be called with
+ * allocator->lock held.
+ */
+static size_t
+take_from_slabs (SlabAllocator *allocator, void **objs, size_t n)
+{
+	size_t i = 0;
+	while (i < n) {
+		Page *page;
+		if (allocator->nr_partial) {
+			page = allocator->page_partial.pop_front ();
+			allocator->nr_partial--;
+		} else if (allocator->nr_full) {
+			page = allocator->page_full.pop_front ();
+			allocator->nr_full--;
+		} else if (drain_remote_frees (allocator))
+			continue;
+		else
+			break;
+
+		while (page->slab.nfree && i < n) {
+			void *obj = page->slab.pobj;
+			page->slab.pobj = *free_ptr (allocator, obj);
+			page->slab.nfree--;
+			allocator->nfree--;
+			objs[i++] = obj;
+		}
+
+		if (!page->slab.nfree)
 			allocator->nr_empty++;
 		else {
 			allocator->nr_partial++;
 			allocator->page_partial.push_front (page);
 		}
-
-		allocator->nfree--;
-		return wrap (allocator, aclass, obj);
 	}
 
-	page = alloc_page (aclass);
-	if (!page)
-		return nullptr;
+	update_peak (allocator);
+	return i;
+}
+
+/**
+ * carve_slab - set up a new slab and take objects from it.
+ * @allocator: the cache
+ * @page: the pages of the new slab
+ * @objs: array that receives the objects
+ * @n: the maximum number of objects to take
+ * Returns the number of objects taken.  The objects are taken straight from
+ * the slab, and only the remaining objects are put on its free list.  This
+ * function must be called with allocator->lock held.
+ */
+static size_t
+carve_slab (SlabAllocator *allocator, Page *page, void **objs, size_t n)
+{
 	page->flags = PAGE_SLAB;
 	page->slab.allocator = allocator;
-	page->slab.nfree = allocator->objs_per_page - 1;
-	void **head = &page->slab.pobj;
+	page->slab.remote_free = nullptr;
+	for (size_t i = 1; i < (1UL << allocator->slab_order); i++) {
+		page[i].flags = PAGE_SLAB | PAGE_TAIL;
+		page[i].tail.head = page;
+	}
+
+	page->slab.color = allocator->color_next;
+	allocator->color_next += allocator->color_step;
+	if (allocator->color_next > allocator->color_max)
+		allocator->color_next = 0;
+
+	uintptr_t addr = page_to_virt (page) + page->slab.color;
+	if (allocator->ctor)
+		for (size_t i = 0; i < allocator->objs_per_slab; i++)
+			allocator->ctor ((void *) (addr + i * allocator->real_obj_size));
 
-	uintptr_t addr = page_to_virt (page);
-	for (size_t i = 1; i < allocator->objs_per_page; i++) {
+	size_t taken = dsl::min (n, allocator->objs_per_slab);
+	for (size_t i = 0; i < taken; i++)
+		objs[i] = (void *) (addr + i * allocator->real_obj_size);
+
+	page->slab.nfree = allocator->objs_per_slab - taken;
+	void **head = &page->slab.pobj;
+	for (size_t i = taken; i < allocator->objs_per_slab; i++) {
 		void *obj = (void *) (addr + i * allocator->real_obj_size);
 		*head = obj;
-		head = new (obj) void *;
+		head = new (free_ptr (allocator, obj)) void *;
 	}
 	*head = nullptr;
-	allocator->nfree += allocator->objs_per_page - 1;
-	allocator->nr_partial++;
-	allocator->page_partial.push_front (page);
-	return wrap (allocator, aclass, (void *) addr);
+
+	allocator->nfree += page->slab.nfree;
+	if (!page->slab.nfree)
+		allocator->nr_empty++;
+	else {
+		allocator->nr_partial++;
+		allocator->page_partial.push_front (page);
+	}
+
+	count_event (allocator, &slab_cpu_stats::slabs_grabbed);
+	update_peak (allocator);
+	return taken;
 }
 
-void
-slab_free (void *ptr)
+void *
+slab_alloc (SlabAllocator *allocator, allocation_class aclass)
 {
-	Page *page = virt_to_page ((uintptr_t) ptr);
-	SlabAllocator *allocator = page->slab.allocator;
+	aclass = ALLOC_KERNEL | (aclass & (__ALLOC_HIGHPRIO | __ALLOC_ZERO));
+
+	if (allocator->cpu_caches) [[likely]] {
+		void *obj = magazine_alloc (allocator);
+		if (obj) [[likely]]
+			return wrap (allocator, aclass, obj);
+	}
+
+	void *obj;
+	scoped_spinlock_dpc g (allocator->lock);
+	if (!take_from_slabs (allocator, &obj, 1)) {
+		Page *page = alloc_pages (allocator->slab_order, aclass);
+		if (!page)
+			return nullptr;
+		carve_slab (allocator, page, &obj, 1);
+	}
+
+	count_event (allocator, &slab_cpu_stats::allocs);
+
+	return wrap (allocator, aclass, obj);
+}
 
+/**
+ * slab_alloc_bulk - allocate a number of objects from a cache at once.
+ * @allocator: the cache
+ * @aclass: allocation class
+ * @n: the number of objects to allocate
+ * @objs: array that receives the objects
+ * Returns true if all @n objects were allocated.  On failure, no objects are
+ * allocated.
+ */
+bool
+slab_alloc_bulk (SlabAllocator *allocator, allocation_class aclass,
+		size_t n, void **objs)
+{
+	aclass = ALLOC_KERNEL | (aclass & (__ALLOC_HIGHPRIO | __ALLOC_ZERO));
+
+	size_t i = 0;
+	bool surplus = false;
 	{
 		scoped_spinlock_dpc g (allocator->lock);
-		allocator->nfree++;
-
-		void **head = new (ptr) void *;
-		*head = page->slab.pobj;
-		page->slab.pobj = ptr;
-		page->slab.nfree++;
-		if (page->slab.nfree == 1) {
-			allocator->nr_empty--;
+		i = take_from_slabs (allocator, objs, n);
+		while (i < n) {
+			Page *page = alloc_pages (allocator->slab_order, aclass);
+			if (!page)
+				break;
+			i += carve_slab (allocator, page, objs + i, n - i);
+		}
+
+		if (i == n)
+			count_event (allocator, &slab_cpu_stats::allocs, n);
+		else {
+			/*
+			 * Give back what we took.  These objects were never
+			 * counted as allocated, so do not count them as freed.
+			 */
+			for (size_t j = 0; j < i; j++)
+				free_to_slab (allocator,
+					page_head (virt_to_page ((uintptr_t) objs[j])),
+					objs[j]);
+
+			surplus = allocator->nr_full > allocator->empty_reserve;
+		}
+	}
+
+	if (i < n) {
+		if (surplus)
+			arm_slab_reap ();
+		return false;
+	}
+
+	for (i = 0; i < n; i++)
+		objs[i] = wrap (allocator, aclass, objs[i]);
+	return true;
+}
+
+static void
+free_slab_now (Page *page, unsigned int order)
+{
+	for (size_t i = 1; i < (1UL << order); i++)
+		page[i].flags = 0;
+
+	free_pages (page, order);
+}
+
+static void
+free_slab_rcu (RCUHead *head)
+{
+	Page *page = container_of (&Page::rcu_head, head);
+	free_slab_now (page, page->slab.allocator->slab_order);
+}
+
+/**
+ * free_slab - give a slab back to the page allocator.
+ * @allocator: the cache
+ * @page: head page of the slab
+ *
+ * The slabs of type-stable caches are only freed after a grace period, during
+ * which the pages stay marked as slab pages of the cache.
+ */
+static void
+free_slab (SlabAllocator *allocator, Page *page)
+{
+	if (allocator->flags & SLAB_TYPESAFE_RCU)
+		rcu_call (&page->rcu_head, free_slab_rcu);
+	else
+		free_slab_now (page, allocator->slab_order);
+}
+
+/**
+ * free_to_slab - put an object back on its slab.
+ * @allocator: the cache
+ * @page: head page of the slab that the object belongs to
+ * @ptr: the object
+ *
+ * Slabs that become entirely free are kept on page_full.  This function must be
+ * called with allocator->lock held.
+ */
+static void
+free_to_slab (SlabAllocator *allocator, Page *page, void *ptr)
+{
+	allocator->nfree++;
+
+	void **head = new (free_ptr (allocator, ptr)) void *;
+	*head = page->slab.pobj;
+	page->slab.pobj = ptr;
+	page->slab.nfree++;
+	if (page->slab.nfree == 1) {
+		allocator->nr_empty--;
+		if (allocator->objs_per_slab != 1) {
 			allocator->nr_partial++;
 			allocator->page_partial.push_front (page);
 			return;
-		} else if (page->slab.nfree != allocator->objs_per_page)
-			return;
-
+		}
+	} else if (page->slab.nfree != allocator->objs_per_slab)
+		return;
+	else {
 		page->node.remove ();
 		allocator->nr_partial--;
-		if (allocator->nr_full < 1) {
-			allocator->nr_full++;
-			allocator->page_full.push_front (page);
-			return;
+	}
+
+	allocator->nr_full++;
+	allocator->page_full.push_front (page);
+}
+
+void
+slab_free (void *ptr)
+{
+	Page *page = page_head (virt_to_page ((uintptr_t) ptr));
+	SlabAllocator *allocator = page->slab.allocator;
+
+	if (allocator->cpu_caches && magazine_free (allocator, ptr)) [[likely]]
+		return;
+
+	disable_dpc ();
+	count_event (allocator, &slab_cpu_stats::frees);
+	if (!allocator->lock.raw_trylock ()) {
+		count_event (allocator, &slab_cpu_stats::remote_frees);
+		remote_free (allocator, page, ptr);
+		enable_dpc ();
+
+		/* Let decay_cache pick the object up if nobody else does.  */
+		arm_slab_reap ();
+		return;
+	}
+
+	free_to_slab (allocator, page, ptr);
+
+	/*
+	 * Objects freed while the lock was contended would otherwise only be
+	 * seen once the cache runs out of free objects, and the slabs they
+	 * empty would never be released.
+	 */
+	drain_remote_frees (allocator);
+	bool surplus = allocator->nr_full > allocator->empty_reserve;
+	allocator->lock.raw_unlock ();
+	enable_dpc ();
+
+	if (surplus)
+		arm_slab_reap ();
+}
+
+/**
+ * slab_free_bulk - free a number of objects at once.
+ * @n: the number of objects
+ * @objs: the objects
+ *
+ * The objects may belong to different caches.  The lock of a cache is held
+ * across runs of consecutive objects that belong to it.
+ */
+void
+slab_free_bulk (size_t n, void **objs)
+{
+	size_t i = 0;
+	while (i < n) {
+		Page *page = page_head (virt_to_page ((uintptr_t) objs[i]));
+		SlabAllocator *allocator = page->slab.allocator;
+
+		bool surplus;
+		{
+			scoped_spinlock_dpc g (allocator->lock);
+			do {
+				count_event (allocator, &slab_cpu_stats::frees);
+				free_to_slab (allocator, page, objs[i]);
+				if (++i == n)
+					break;
+				page = page_head (virt_to_page ((uintptr_t) objs[i]));
+			} while (page->slab.allocator == allocator);
+
+			drain_remote_frees (allocator);
+			surplus = allocator->nr_full > allocator->empty_reserve;
+		}
+
+		if (surplus)
+			arm_slab_reap ();
+	}
+}
+
+/**
+ * slab_set_reserve - set the number of empty slabs a cache holds on to.
+ * @allocator: the cache
+ * @nr_slabs: the number of entirely free slabs to keep
+ *
+ * Caches that frequently cross a slab boundary can use a larger reserve to avoid
+ * going back and forth to the page allocator.  The reserve is only given back
+ * when memory runs low.
+ */
+void
+slab_set_reserve (SlabAllocator *allocator, size_t nr_slabs)
+{
+	bool surplus;
+	{
+		scoped_spinlock_dpc g (allocator->lock);
+		allocator->empty_reserve = nr_slabs;
+		surplus = allocator->nr_full > nr_slabs;
+	}
+
+	if (surplus)
+		arm_slab_reap ();
+}
+
+/**
+ * shrink_cache - give empty slabs of a cache back to the page allocator.
+ * @allocator: the cache
+ * @keep: the number of empty slabs to keep
+ * @max_free: the maximum number of slabs to free
+ * Returns the number of pages freed.
+ */
+static size_t
+shrink_cache (SlabAllocator *allocator, size_t keep, size_t max_free)
+{
+	PageList pages;
+	size_t n = 0;
+	{
+		scoped_spinlock_dpc g (allocator->lock);
+		while (allocator->nr_full > keep && n < max_free) {
+			pages.push_back (allocator->page_full.pop_front ());
+			allocator->nr_full--;
+			allocator->nfree -= allocator->objs_per_slab;
+			n++;
 		}
 
-		allocator->nfree -= allocator->objs_per_page;
+		count_event (allocator, &slab_cpu_stats::slabs_released, n);
 	}
 
-	free_page (page);
+	while (!pages.empty ())
+		free_slab (allocator, pages.pop_front ());
+
+	return n << allocator->slab_order;
+}
+
+/**
+ * flush_depot - return the objects held in the depot of a cache to its slabs.
+ * @allocator: the cache
+ *
+ * Magazines loaded on a CPU are left alone.  Objects on remote_free lists are
+ * returned as well.
+ */
+static void
+flush_depot (SlabAllocator *allocator)
+{
+	MagazineList mags;
+	{
+		scoped_spinlock_dpc g (allocator->lock);
+		drain_remote_frees (allocator);
+		while (!allocator->depot_full.empty ()) {
+			Magazine *mag = allocator->depot_full.pop_front ();
+			for (unsigned int i = 0; i < mag->rounds; i++) {
+				void *obj = mag->objs[i];
+				Page *page = page_head (virt_to_page ((uintptr_t) obj));
+				free_to_slab (allocator, page, obj);
+			}
+			mags.push_back (mag);
+		}
+
+		while (!allocator->depot_empty.empty ())
+			mags.push_back (allocator->depot_empty.pop_front ());
+
+		allocator->nr_depot_full = 0;
+		allocator->nr_depot_empty = 0;
+	}
+
+	while (!mags.empty ())
+		slab_free (mags.pop_front ());
 }
 
 static dsl::TypedList<SlabAllocator, &SlabAllocator::listHead> globalSlabList;
 static spinlock_t globalSlabSpinlock;
 
-static SlabAllocator slab_allocator;
+/**
+ * decay_cache - free half of the surplus empty slabs of a cache.
+ * Returns true if the cache still has a surplus afterwards.
+ */
+static bool
+decay_cache (SlabAllocator *allocator)
+{
+	size_t reserve, surplus;
+	{
+		scoped_spinlock_dpc g (allocator->lock);
+		drain_remote_frees (allocator);
+		reserve = allocator->empty_reserve;
+		surplus = allocator->nr_full > reserve
+			? allocator->nr_full - reserve : 0;
+	}
+
+	if (!surplus)
+		return false;
+
+	shrink_cache (allocator, reserve, (surplus + 1) / 2);
+	return surplus > 1;
+}
+
+static void
+slab_reap_fn (KTimer *tmr, void *arg)
+{
+	(void) arg;
+
+	/*
+	 * Clear the armed flag before looking at the caches, so that a surplus
+	 * created while we run re-arms the timer.
+	 */
+	atomic_store_release (&slab_reap_armed, false);
+
+	bool again = decay_cache (&slab_allocator);
+	again |= decay_cache (&magazine_allocator);
+	{
+		scoped_spinlock_dpc g (globalSlabSpinlock);
+		for (SlabAllocator *allocator : globalSlabList)
+			again |= decay_cache (allocator);
+	}
+
+	if (again && !atomic_exchange_acquire (&slab_reap_armed, true))
+		tmr->enqueue (ns_since_boot () + slab_reap_interval);
+}
+
+/**
+ * slab_shrink - give memory held by the slab allocator back under pressure.
+ *
+ * Caches are shrunk in three passes of increasing cost: first the surplus empty
+ * slabs, then the objects cached in the depots, and finally the reserves.
+ */
+static size_t
+slab_shrink (Shrinker *shrinker, size_t nr_pages)
+{
+	(void) shrinker;
+
+	size_t freed = 0;
+	scoped_spinlock_dpc g (globalSlabSpinlock);
+	for (int pass = 0; pass < 3 && freed < nr_pages; pass++) {
+		for (SlabAllocator *allocator : globalSlabList) {
+			if (freed >= nr_pages)
+				break;
+
+			size_t keep = allocator->empty_reserve;
+			if (pass == 1)
+				flush_depot (allocator);
+			else if (pass == 2)
+				keep = 0;
+
+			freed += shrink_cache (allocator, keep, -1UL);
+		}
+	}
+
+	freed += shrink_cache (&magazine_allocator, 0, -1UL);
+	return freed;
+}
+
+static Shrinker slab_shrinker;
+
+/**
+ * slab_get_stats - read the statistics of a cache.
+ * @allocator: the cache
+ * @stats: structure to fill in
+ *
+ * The event counters are summed over all CPUs without stopping allocation, so
+ * they may be slightly out of date with respect to each other.
+ */
+void
+slab_get_stats (SlabAllocator *allocator, slab_stats *stats)
+{
+	memset (stats, 0, sizeof (*stats));
+	strncpy (stats->name, allocator->name, sizeof (stats->name));
+	stats->obj_size = allocator->inp_obj_size;
+	stats->objs_per_slab = allocator->objs_per_slab;
+	stats->slab_order = allocator->slab_order;
+	stats->peak_inuse = atomic_load_relaxed (&allocator->peak_inuse);
+
+	{
+		scoped_spinlock_dpc g (allocator->lock);
+		stats->nr_slabs = allocator->nr_full + allocator->nr_partial
+			+ allocator->nr_empty;
+		stats->nr_free = allocator->nfree;
+		stats->nr_depot_full = allocator->nr_depot_full;
+	}
+
+	if (!allocator->cpu_caches)
+		return;
+
+	for (unsigned int cpu = 0; cpu < nr_cpus; cpu++) {
+		slab_cpu_stats *cs = &allocator->cpu_caches[cpu].stats;
+		stats->allocs += atomic_load_relaxed (&cs->allocs);
+		stats->frees += atomic_load_relaxed (&cs->frees);
+		stats->fast_allocs += atomic_load_relaxed (&cs->fast_allocs);
+		stats->fast_frees += atomic_load_relaxed (&cs->fast_frees);
+		stats->refills += atomic_load_relaxed (&cs->refills);
+		stats->drains += atomic_load_relaxed (&cs->drains);
+		stats->slabs_grabbed += atomic_load_relaxed (&cs->slabs_grabbed);
+		stats->slabs_released += atomic_load_relaxed (&cs->slabs_released);
+		stats->remote_frees += atomic_load_relaxed (&cs->remote_frees);
+	}
+}
+
+/**
+ * slab_find - look up a cache by name.
+ * @name: the name that was passed to slab_create
+ * Returns NULL if there is no such cache.
+ */
+SlabAllocator *
+slab_find (const char *name)
+{
+	scoped_spinlock_dpc g (globalSlabSpinlock);
+	for (SlabAllocator *allocator : globalSlabList)
+		if (!strcmp (allocator->name, name))
+			return allocator;
+
+	return nullptr;
+}
+
+/**
+ * slab_collect_stats - read the statistics of every cache.
+ * @stats: array to fill in
+ * @max: number of elements in @stats
+ * Returns the number of caches, which may be larger than @max.
+ */
+size_t
+slab_collect_stats (slab_stats *stats, size_t max)
+{
+	size_t n = 0;
+	scoped_spinlock_dpc g (globalSlabSpinlock);
+	for (SlabAllocator *allocator : globalSlabList) {
+		if (n < max)
+			slab_get_stats (allocator, &stats[n]);
+		n++;
+	}
+
+	return n;
+}
 
 static void
 dump_one (SlabAllocator *allocator)
 {
 	size_t obj_size = allocator->real_obj_size;
-	size_t per_page = allocator->objs_per_page;
-	size_t nr_full, nr_partial, nr_empty, nfree;
+	size_t per_slab = allocator->objs_per_slab;
+	unsigned int order = allocator->slab_order;
+	size_t nr_full, nr_partial, nr_empty, nfree, nr_mags;
 	{
 		scoped_spinlock_dpc g (allocator->lock);
 		nr_full = allocator->nr_full;
 		nr_partial = allocator->nr_partial;
 		nr_empty = allocator->nr_empty;
 		nfree = allocator->nfree;
+		nr_mags = allocator->nr_depot_full;
 	}
 
-	printk (PR_INFO ".. %-16s %4zu %3zu   %4zu %4zu %4zu  %4zu %4zu\n",
+	printk (PR_INFO ".. %-16s %4zu %3zu %u  %4zu %4zu %4zu  %4zu %4zu %4zu\n",
 			allocator->name,
-			obj_size, per_page,
+			obj_size, per_slab, order,
 			nr_full, nr_partial, nr_empty,
-			per_page * (nr_full + nr_partial + nr_empty),
-			nfree);
+			per_slab * (nr_full + nr_partial + nr_empty),
+			nfree, nr_mags);
 }
 
 void
 slab_dump (void)
 {
 	printk (PR_INFO "Slab allocators:\n");
-	printk (PR_INFO ".. name            size perpg full part empt  ntot nfree\n");
+	printk (PR_INFO ".. name            size per o  full part empt  ntot nfree dmag\n");
 	dump_one (&slab_allocator);
+	dump_one (&magazine_allocator);
 	scoped_spinlock_dpc g (globalSlabSpinlock);
 	for (SlabAllocator *allocator : globalSlabList)
 		dump_one (allocator);
 }
 
+/**
+ * alloc_cpu_caches - allocate the per-CPU magazine pointers of a cache.
+ */
+static slab_cpu_cache *
+alloc_cpu_caches (void)
+{
+	size_t size = nr_cpus * sizeof (slab_cpu_cache);
+	unsigned int order = 0;
+	while ((PAGE_SIZE << order) < size)
+		order++;
+
+	Page *page = alloc_pages (order, ALLOC_KERNEL | __ALLOC_ZERO);
+	return page ? (slab_cpu_cache *) page_to_virt (page) : nullptr;
+}
+
+/**
+ * The largest slabs we use, and the most of a slab we are willing to lose to
+ * rounding, as a fraction 1/slab_max_waste of the slab.
+ */
+static constexpr unsigned int slab_max_order = 3;
+static constexpr size_t slab_max_waste = 8;
+
+/**
+ * choose_slab_order - pick the size of the slabs for a cache.
+ * @obj_size: size of the objects, including any padding
+ * Returns the smallest order at which rounding wastes no more than
+ * 1/slab_max_waste of the slab, or the order that wastes the least.
+ */
+static unsigned int
+choose_slab_order (size_t obj_size)
+{
+	unsigned int best = 0;
+	size_t best_waste = (size_t) -1;
+	for (unsigned int order = 0; order <= slab_max_order; order++) {
+		size_t slab_size = PAGE_SIZE << order;
+		if (slab_size < obj_size)
+			continue;
+
+		size_t waste = slab_size % obj_size;
+		if (waste * slab_max_waste <= slab_size)
+			return order;
+
+		/* Compare waste relative to slab size.  */
+		if ((waste << (slab_max_order - order)) < best_waste) {
+			best = order;
+			best_waste = waste << (slab_max_order - order);
+		}
+	}
+
+	return best;
+}
+
 static void
 init_new_allocator (SlabAllocator *allocator, const char *name,
 		size_t inp_obj_size, size_t inp_obj_align,
@@ -186,13 +1058,30 @@ init_new_allocator (SlabAllocator *allocator, const char *name,
 	allocator->inp_obj_size = inp_obj_size;
 	allocator->inp_obj_align = inp_obj_align;
 	allocator->real_obj_size = real_obj_size;
-	allocator->objs_per_page = PAGE_SIZE / real_obj_size;
+	allocator->slab_order = choose_slab_order (real_obj_size);
+	allocator->objs_per_slab = (PAGE_SIZE << allocator->slab_order)
+		/ real_obj_size;
+	allocator->free_offset = 0;
+	allocator->color_step = 0;
+	allocator->color_max = 0;
+	allocator->color_next = 0;
+	allocator->flags = 0;
+	allocator->ctor = nullptr;
 	strncpy (allocator->name, name, sizeof (allocator->name));
 	allocator->name[sizeof (allocator->name) - 1] = 0;
+	allocator->empty_reserve = slab_default_reserve;
+	allocator->cpu_caches = nullptr;
+	allocator->depot_full.init ();
+	allocator->depot_empty.init ();
+	allocator->nr_depot_full = 0;
+	allocator->nr_depot_empty = 0;
+	allocator->remote_pages = nullptr;
+	allocator->peak_inuse = 0;
 }
 
 SlabAllocator *
-slab_create (const char *name, size_t size, size_t align)
+slab_create (const char *name, size_t size, size_t align,
+		slab_flags_t flags, void (*ctor) (void *))
 {
 	if (align & (align - 1)) {
 		printk (PR_ERROR "slab_create():  align=%zu is not a power-of-two!\n",
@@ -200,7 +1089,7 @@ slab_create (const char *name, size_t size, size_t align)
 		return nullptr;
 	}
 
-	if (size > PAGE_SIZE / 2 || align > PAGE_SIZE / 2) {
+	if (size > (PAGE_SIZE << slab_max_order) / 4 || align > PAGE_SIZE) {
 		printk (PR_ERROR "slab_create():  requested object size is too large for slab allocation!\n");
 		return nullptr;
 	}
@@ -210,14 +1099,40 @@ slab_create (const char *name, size_t size, size_t align)
 		return nullptr;
 	}
 
+	if (flags & SLAB_CACHELINE_ALIGN) {
+		size_t line = CACHELINE_SIZE;
+		while (size <= line / 2 && line > sizeof (void *))
+			line /= 2;
+		align = dsl::max (align, line);
+	}
+
 	if (sizeof (void *) > align)
 		align = sizeof (void *);
 	size_t realsize = dsl::align_up (size, align);
+	size_t free_offset = 0;
+	if (ctor || (flags & SLAB_TYPESAFE_RCU)) {
+		free_offset = dsl::align_up (size, sizeof (void *));
+		realsize = dsl::align_up (free_offset + sizeof (void *), align);
+	}
+
 	SlabAllocator *allocator = (SlabAllocator *) slab_alloc (&slab_allocator, ALLOC_KERNEL);
 	if (!allocator)
 		return nullptr;
 
 	init_new_allocator (allocator, name, size, align, realsize);
+	allocator->free_offset = free_offset;
+	allocator->flags = flags;
+	allocator->ctor = ctor;
+
+	size_t leftover = (PAGE_SIZE << allocator->slab_order)
+		- allocator->objs_per_slab * realsize;
+	allocator->color_step = dsl::max (align, (size_t) CACHELINE_SIZE);
+	allocator->color_max = dsl::align_down (leftover, allocator->color_step);
+	allocator->cpu_caches = alloc_cpu_caches ();
+	if (!allocator->cpu_caches) {
+		slab_free (allocator);
+		return nullptr;
+	}
 
 	scoped_spinlock_dpc g (globalSlabSpinlock);
 	globalSlabList.push_back (allocator);
@@ -225,18 +1140,89 @@ slab_create (const char *name, size_t size, size_t align)
 	return allocator;
 }
 
-static SlabAllocator *kmalloc_slabs[9];
-static size_t kmalloc_sizes[9] = { 8, 16, 32, 64, 128, 256, 512, 1024, 2048 };
+/**
+ * kmalloc size classes.  Between the powers of two sit classes 1.5 times as
+ * large, so that no more than a third of an object is wasted to rounding.
+ */
+static constexpr size_t kmalloc_sizes[] = {
+	8, 16, 32, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072
+};
+
+static constexpr size_t nr_kmalloc_sizes =
+	sizeof (kmalloc_sizes) / sizeof (kmalloc_sizes[0]);
+
+static constexpr size_t kmalloc_max_size = kmalloc_sizes[nr_kmalloc_sizes - 1];
+
+/**
+ * Every class is a multiple of eight bytes, so the class for a size can be
+ * found by indexing a table with the size in units of eight bytes.
+ */
+struct kmalloc_index_table {
+	unsigned char index[kmalloc_max_size / 8 + 1];
+
+	constexpr kmalloc_index_table (void)
+		: index {}
+	{
+		size_t i = 0;
+		for (size_t n = 0; n <= kmalloc_max_size / 8; n++) {
+			while (kmalloc_sizes[i] < 8 * n)
+				i++;
+			index[n] = i;
+		}
+	}
+};
+
+static constexpr kmalloc_index_table kmalloc_index;
+
+static SlabAllocator *kmalloc_slabs[nr_kmalloc_sizes];
+
+/**
+ * kmalloc_pages - allocate a kmalloc object that is too large for the slabs.
+ *
+ * Objects of up to 2^max_page_order pages are taken from the page allocator
+ * and addressed through the direct map.  Anything larger than that, or any
+ * object for which no contiguous block is available, is mapped into the vmap
+ * area.
+ */
+static void *
+kmalloc_pages (size_t size, allocation_class aclass)
+{
+	aclass = ALLOC_KERNEL | (aclass & (__ALLOC_HIGHPRIO | __ALLOC_ZERO));
+
+	unsigned int order = 0;
+	while ((PAGE_SIZE << order) < size)
+		order++;
+
+	if (order <= max_page_order) {
+		Page *page = alloc_pages (order, aclass);
+		if (page) [[likely]] {
+			page->flags = PAGE_LARGE;
+			page->large.order = order;
+			return (void *) page_to_virt (page);
+		}
+
+		/*
+		 * Memory may be too fragmented for a block of this order, but
+		 * kmalloc_large only needs single pages.
+		 */
+		if (!order)
+			return nullptr;
+	}
+
+	void *ptr = kmalloc_large (size);
+	if (ptr && (aclass & __ALLOC_ZERO))
+		memset (ptr, 0, dsl::align_up (size, PAGE_SIZE));
+	return ptr;
+}
 
 void *
 kmalloc (size_t size, allocation_class aclass)
 {
-	for (int i = 0; i < 9; i++) {
-		if (kmalloc_sizes[i] >= size)
-			return slab_alloc (kmalloc_slabs[i], aclass);
-	}
+	if (size > kmalloc_max_size) [[unlikely]]
+		return kmalloc_pages (size, aclass);
 
-	return nullptr;
+	return slab_alloc (kmalloc_slabs[kmalloc_index.index[(size + 7) / 8]],
+			aclass);
 }
 
 void
@@ -246,22 +1232,188 @@ kfree (void *ptr)
 		return;
 	}
 
+	uintptr_t addr = (uintptr_t) ptr;
+	if (addr >= KERNEL_VM_FIRST && addr <= KERNEL_VM_LAST) [[unlikely]] {
+		kfree_large (ptr);
+		return;
+	}
+
+	Page *page = virt_to_page (addr);
+	if (page->flags & PAGE_LARGE) [[unlikely]] {
+		free_pages (page, page->large.order);
+		return;
+	}
+
 	slab_free (ptr);
 }
 
+/**
+ * kfree_rcu batches are page-sized arrays of pointers.  A batch is handed to
+ * rcu_call once it is full, or kfree_rcu_delay after its first pointer was
+ * added, whichever comes first.
+ */
+struct kfree_rcu_batch {
+	RCUHead rcu;
+	size_t nr;
+	void *ptrs[];
+};
+
+static constexpr size_t kfree_rcu_batch_size =
+	(PAGE_SIZE - sizeof (kfree_rcu_batch)) / sizeof (void *);
+
+static constexpr nsecs_t kfree_rcu_delay = 10000000 /* 10ms */;
+
+static DEFINE_PERCPU(kfree_rcu_batch *, kfree_rcu_current);
+static DEFINE_PERCPU(KTimer, kfree_rcu_timer);
+
+/**
+ * object_start - find the start of the kmalloc object containing ptr.
+ */
+static void *
+object_start (void *ptr)
+{
+	uintptr_t addr = (uintptr_t) ptr;
+	if (addr >= KERNEL_VM_FIRST && addr <= KERNEL_VM_LAST)
+		/* kfree_large accepts any pointer into the allocation.  */
+		return ptr;
+
+	Page *page = virt_to_page (addr);
+	if (page->flags & PAGE_SLAB) {
+		page = page_head (page);
+		SlabAllocator *allocator = page->slab.allocator;
+		uintptr_t base = page_to_virt (page) + page->slab.color;
+		size_t i = (addr - base) / allocator->real_obj_size;
+		return (void *) (base + i * allocator->real_obj_size);
+	}
+
+	/* The tail pages of PAGE_LARGE allocations have no flags.  */
+	while (!(page->flags & PAGE_LARGE))
+		page--;
+	return (void *) page_to_virt (page);
+}
+
+static void
+kfree_rcu_head (RCUHead *head)
+{
+	kfree (object_start (head));
+}
+
+static void
+kfree_rcu_batch_fn (RCUHead *head)
+{
+	kfree_rcu_batch *batch = container_of (&kfree_rcu_batch::rcu, head);
+
+	/*
+	 * Free the slab objects in one slab_free_bulk call, and everything
+	 * else one by one.
+	 */
+	size_t nr_slab = 0;
+	for (size_t i = 0; i < batch->nr; i++) {
+		void *ptr = batch->ptrs[i];
+		uintptr_t addr = (uintptr_t) ptr;
+		if ((addr < KERNEL_VM_FIRST || addr > KERNEL_VM_LAST)
+				&& ptr_is_slab (ptr))
+			batch->ptrs[nr_slab++] = ptr;
+		else
+			kfree (ptr);
+	}
+
+	slab_free_bulk (nr_slab, batch->ptrs);
+	free_page (virt_to_page ((uintptr_t) batch));
+}
+
+/**
+ * kfree_rcu_submit - hand this CPU's current batch to RCU.
+ */
+static void
+kfree_rcu_submit (void)
+{
+	kfree_rcu_batch *batch = percpu_read (kfree_rcu_current);
+	if (!batch)
+		return;
+
+	percpu_write (kfree_rcu_current, (kfree_rcu_batch *) nullptr);
+	rcu_call (&batch->rcu, kfree_rcu_batch_fn);
+}
+
+static void
+kfree_rcu_timer_fn (KTimer *tmr, void *arg)
+{
+	(void) tmr;
+	(void) arg;
+
+	kfree_rcu_submit ();
+}
+
+PERCPU_CONSTRUCTOR(kfree_rcu)
+{
+	*percpu_ptr (kfree_rcu_current).on (cpu) = nullptr;
+	percpu_ptr (kfree_rcu_timer).on (cpu)->init (kfree_rcu_timer_fn, nullptr);
+}
+
+/**
+ * kfree_rcu_ptr - free a kmalloc'ed object after an RCU grace period.
+ * @ptr: the object
+ * @head: an RCUHead inside the object
+ *
+ * Use the kfree_rcu macro instead of calling this directly.
+ */
+void
+kfree_rcu_ptr (void *ptr, RCUHead *head)
+{
+	scoped_dpc g;
+
+	kfree_rcu_batch *batch = percpu_read (kfree_rcu_current);
+	if (!batch) {
+		Page *page = alloc_page (ALLOC_KERNEL);
+		if (!page) {
+			rcu_call (head, kfree_rcu_head);
+			return;
+		}
+
+		batch = (kfree_rcu_batch *) page_to_virt (page);
+		batch->nr = 0;
+		percpu_write (kfree_rcu_current, batch);
+
+		KTimer *tmr = percpu_ptr (kfree_rcu_timer);
+		tmr->enqueue (ns_since_boot () + kfree_rcu_delay);
+	}
+
+	batch->ptrs[batch->nr++] = ptr;
+	if (batch->nr == kfree_rcu_batch_size) {
+		KTimer *tmr = percpu_ptr (kfree_rcu_timer);
+		tmr->remove ();
+		kfree_rcu_submit ();
+	}
+}
+
 void
 kmalloc_init (void)
 {
+	slab_reap_timer.init (slab_reap_fn, nullptr);
+
 	init_new_allocator (&slab_allocator, "SlabAllocator",
 			sizeof (SlabAllocator), sizeof (void *),
 			dsl::align_up (sizeof (SlabAllocator), 8 * sizeof (void *)));
 
-	for (int i = 0; i < 9; i++) {
+	/*
+	 * Magazines come from a cache without magazines of its own, so that
+	 * getting an empty magazine never recurses.
+	 */
+	init_new_allocator (&magazine_allocator, "Magazine",
+			sizeof (Magazine), sizeof (void *),
+			dsl::align_up (sizeof (Magazine), sizeof (void *)));
+
+	for (size_t i = 0; i < nr_kmalloc_sizes; i++) {
 		char name[32];
 		size_t size = kmalloc_sizes[i];
 		snprintf (name, sizeof (name), "kmalloc-%zu", size);
-		kmalloc_slabs[i] = slab_create (name, size, size);
+		/* Align objects to the largest power of two dividing their size.  */
+		kmalloc_slabs[i] = slab_create (name, size, size & -size);
 		if (!kmalloc_slabs[i])
 			panic ("init_kmalloc:  failed to create %s", name);
 	}
+
+	slab_shrinker.shrink = slab_shrink;
+	register_shrinker (&slab_shrinker);
 }
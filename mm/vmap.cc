@@ -1,8 +1,30 @@
 /**
  * Kernel virtual address space management.
  * Copyright (C) 2025-present  dbstream
+ *
+ * Unmapping a vmap area requires a TLB shootdown before its address range and
+ * its pages can be reused.  Instead of doing this on every vunmap, we clear the
+ * page table entries right away but leave the area in the vmap_tree, so that
+ * its address range is not handed out again, and add it to lazy_list.  Once
+ * lazy_max_pages pages are pending, or when we run out of address space, a
+ * single shootdown covering all of them is done and the areas are released.
+ *
+ * Small mappings do not get an area of their own.  Every CPU instead reserves a
+ * vmap block of vmap_block_pages pages at a time, and carves mappings of up to
+ * vmap_block_max_pages pages out of it with a bump pointer, leaving a guard page
+ * after each.  This needs neither vmap_lock nor an insertion into the tree.
+ * Address space in a block is never reused; once a CPU has moved on to another
+ * block and every mapping in the old one has been freed, the old block is freed
+ * like any other area.
+ *
+ * Where a mapping covers an aligned 2 MiB or 1 GiB range of virtual and
+ * physical memory, it is mapped using a single huge page table entry instead of
+ * a whole page table.  vmap_io_range and kmalloc_large ask for address space
+ * that is aligned accordingly.
  */
+#include <asm/percpu.h>
 #include <asm/pgtable_modify.h>
+#include <davix/irql.h>
 #include <davix/kmalloc.h>
 #include <davix/page.h>
 #include <davix/spinlock.h>
@@ -10,18 +32,58 @@
 #include <dsl/align.h>
 #include <dsl/minmax.h>
 #include <dsl/vmatree.h>
+#include <container_of.h>
 
 #include <davix/printk.h>
 
 struct vmap_area {
 	dsl::VMANode node;
+	dsl::ListHead lazy_node;
+	bool lazy;
+	bool block;
 };
 
+static constexpr size_t vmap_block_pages = 512;
+static constexpr size_t vmap_block_max_pages = 16;
+
+struct vmap_block {
+	/** This must be the first member, as purge_lazy_areas frees it.  */
+	vmap_area area;
+	spinlock_t lock;
+
+	/** Offset of the next mapping, in pages.  */
+	size_t next;
+
+	/** Number of pages, including guard pages, that were freed.  */
+	size_t nr_freed;
+
+	/** Set once the owning CPU stopped allocating from this block.  */
+	bool retired;
+
+	/** Size in pages of the mapping starting at each offset.  */
+	unsigned char sizes[vmap_block_pages];
+};
+
+static DEFINE_PERCPU(vmap_block *, current_vmap_block);
+
+PERCPU_CONSTRUCTOR(vmap_block)
+{
+	*percpu_ptr (current_vmap_block).on (cpu) = nullptr;
+}
+
 typedef dsl::TypedVMATree<vmap_area, &vmap_area::node> VmapTree;
+typedef dsl::TypedList<vmap_area, &vmap_area::lazy_node> VmapLazyList;
 
 static spinlock_t vmap_lock;
 static VmapTree vmap_tree;
 
+static constexpr size_t lazy_max_pages = 8192;
+
+/** Areas waiting for the next lazy purge; protected by vmap_lock.  */
+static VmapLazyList lazy_list;
+static size_t lazy_nr_pages;
+static tlb_accumulator lazy_tlb;
+
 static void
 __free_pte_range (uintptr_t start, uintptr_t end,
 		bool free_pages,
@@ -36,11 +98,29 @@ __free_pte_range (uintptr_t start, uintptr_t end,
 		pte_clear (pte);
 		tlb_add_range (tlb, start, start + PAGE_SIZE);
 		if (free_pages)
-			free_page (phys_to_page (value.phys_addr ()));
+			/*
+			 * The page must not be reused before every CPU has
+			 * flushed its TLB, so let tlb_end_kernel free it along
+			 * with the page tables.
+			 */
+			tlb_add_page (tlb, phys_to_page (value.phys_addr ()));
 		return;
 	}
 
 	uintptr_t size = __pgtable_entry_size(level + 1);
+	if (value.huge ()) {
+		uintptr_t first = dsl::align_down (start, size);
+		pte_clear (pte);
+		tlb_add_range (tlb, first, first + size);
+		if (free_pages) {
+			/* The PAT bit of huge entries is within phys_addr.  */
+			uintptr_t phys = value.phys_addr () & ~(size - 1);
+			for (uintptr_t i = 0; i < size; i += PAGE_SIZE)
+				tlb_add_page (tlb, phys_to_page (phys + i));
+		}
+		return;
+	}
+
 	bool full = start == dsl::align_down (start, size)
 			&& end == dsl::align_up (end, size);
 
@@ -59,9 +139,9 @@ __free_pte_range (uintptr_t start, uintptr_t end,
 }
 
 static void
-free_pte_range (uintptr_t start, uintptr_t end,
+unmap_pte_range (uintptr_t start, uintptr_t end,
 		uintptr_t floor, uintptr_t ceiling,
-		bool free_pages)
+		bool free_pages, tlb_accumulator *tlb)
 {
 	int level = max_pgtable_level ();
 
@@ -71,75 +151,180 @@ free_pte_range (uintptr_t start, uintptr_t end,
 	if (tmp)
 		ceiling = ceiling ? dsl::min (ceiling, tmp) : tmp;
 
-	tlb_accumulator tlb;
-	tlb_begin_kernel (&tlb);
-
 	pte_t *entry = get_vmap_pgtable_entry (floor);
 	do {
 		uintptr_t next = pgtable_boundary_next (floor, ceiling, level);
-		__free_pte_range (floor, next, free_pages, level - 1, entry, &tlb);
+		__free_pte_range (floor, next, free_pages, level - 1, entry, tlb);
 		floor = next;
 		entry++;
 	} while (floor != ceiling);
+}
 
-	tlb_end_kernel (&tlb);
+/**
+ * purge_lazy_areas - finish unmapping everything that was freed lazily.
+ *
+ * This does one TLB shootdown for all of it, frees the pages, and releases the
+ * address ranges.  This function must be called with vmap_lock held.
+ */
+static void
+purge_lazy_areas (void)
+{
+	if (!lazy_nr_pages)
+		return;
+
+	tlb_end_kernel (&lazy_tlb);
+	while (!lazy_list.empty ()) {
+		vmap_area *vma = lazy_list.pop_front ();
+		vmap_tree.remove (vma);
+		kfree (vma);
+	}
+
+	lazy_nr_pages = 0;
 }
 
+/**
+ * lazy_unmap - clear the page table entries of a range and defer the rest.
+ * @start: first address of the range
+ * @end: end of the range
+ * @floor: lowest address whose page tables we may free
+ * @ceiling: end of the addresses whose page tables we may free, or zero
+ * @free_pages: whether to free the pages that are mapped in the range
+ *
+ * This function must be called with vmap_lock held.
+ */
 static void
-free_pte_range_vma (uintptr_t start, uintptr_t end,
-		vmap_area *vma, bool free_pages)
+lazy_unmap (uintptr_t start, uintptr_t end,
+		uintptr_t floor, uintptr_t ceiling, bool free_pages)
 {
-	vmap_area *prev = vmap_tree.prev (vma);
-	vmap_area *next = vmap_tree.next (vma);
+	if (!lazy_nr_pages)
+		tlb_begin_kernel (&lazy_tlb);
 
-	free_pte_range (start, end,
-			prev ? (prev->node.last + 1) : 0,
-			next ? (next->node.first) : 0,
-			free_pages);
+	unmap_pte_range (start, end, floor, ceiling, free_pages, &lazy_tlb);
+	lazy_nr_pages += (end - start) / PAGE_SIZE;
 }
 
+/**
+ * lazy_free_area - unmap a vmap area and defer the rest of the work.
+ * @vma: the area
+ * @free_pages: whether to free the pages that are mapped in the area
+ *
+ * This function must be called with vmap_lock held.
+ */
 static void
-free_pte_range_entire_vma (vmap_area *vma, bool free_pages)
+lazy_free_area (vmap_area *vma, bool free_pages)
 {
-	free_pte_range_vma (vma->node.first, vma->node.last + 1, vma, free_pages);
+	/*
+	 * Only free page tables that lie within the area itself.  The area
+	 * stays in vmap_tree until the purge, so nothing can be mapped there
+	 * while other CPUs may still cache the tables.  The free space around
+	 * it is not reserved, and a new mapping placed there before the purge
+	 * would install its own tables under stale paging-structure caches.
+	 */
+	lazy_unmap (vma->node.first, vma->node.last + 1,
+			vma->node.first, vma->node.last + 1,
+			free_pages);
+
+	vma->lazy = true;
+	lazy_list.push_back (vma);
+}
+
+/**
+ * block_free - free a mapping that was carved from a vmap block.
+ * @vb: the block
+ * @addr: any address within the mapping
+ * @free_pages: whether to free the pages that are mapped
+ * Returns false if there is no mapping at @addr.  This function must be called
+ * with vmap_lock held.
+ */
+static bool
+block_free (vmap_block *vb, uintptr_t addr, bool free_pages)
+{
+	size_t offset = (addr - vb->area.node.first) / PAGE_SIZE;
+	size_t nr_pages;
+	{
+		scoped_spinlock_dpc g (vb->lock);
+
+		/*
+		 * Find the start of the mapping.  Mappings are at most
+		 * vmap_block_max_pages long, so we need not look far.
+		 */
+		size_t first = offset;
+		while (first && !vb->sizes[first]
+				&& offset - first < vmap_block_max_pages)
+			first--;
+
+		nr_pages = vb->sizes[first];
+		if (offset >= first + nr_pages)
+			return false;
+
+		vb->sizes[first] = 0;
+		offset = first;
+	}
+
+	uintptr_t start = vb->area.node.first + offset * PAGE_SIZE;
+	uintptr_t end = start + nr_pages * PAGE_SIZE;
+	lazy_unmap (start, end, start, end, free_pages);
+
+	bool release;
+	{
+		scoped_spinlock_dpc g (vb->lock);
+		vb->nr_freed += nr_pages + 1;
+		release = vb->retired && vb->nr_freed == vb->next;
+	}
+
+	if (release)
+		lazy_free_area (&vb->area, false);
+	return true;
+}
+
+/**
+ * release_area - unmap the area or block mapping containing an address.
+ * @addr: the address
+ * @free_pages: whether to free the pages that are mapped
+ * Returns false if @addr is not mapped.
+ */
+static bool
+release_area (uintptr_t addr, bool free_pages)
+{
+	scoped_spinlock_dpc g (vmap_lock);
+	vmap_area *vma = vmap_tree.find (addr);
+	if (!vma || vma->lazy)
+		return false;
+
+	if (vma->block) {
+		vmap_block *vb = container_of (&vmap_block::area, vma);
+		if (!block_free (vb, addr, free_pages))
+			return false;
+	} else
+		lazy_free_area (vma, free_pages);
+
+	if (lazy_nr_pages >= lazy_max_pages)
+		purge_lazy_areas ();
+	return true;
 }
 
 void
 vunmap (void *ptr)
 {
-	vmap_lock.lock_dpc ();
-	vmap_area *vma = vmap_tree.find ((uintptr_t) ptr);
-	if (!vma) {
-		vmap_lock.unlock_dpc ();
+	if (!release_area ((uintptr_t) ptr, false))
 		printk (PR_ERROR "vunmap() was called on a pointer which does not exist in the vmap_tree\n");
-		return;
-	}
-
-	free_pte_range_entire_vma (vma, false);
-	vmap_tree.remove (vma);
-	vmap_lock.unlock_dpc ();
-	kfree (vma);
 }
 
 void
 kfree_large (void *ptr)
 {
-	vmap_lock.lock_dpc ();
-	vmap_area *vma = vmap_tree.find ((uintptr_t) ptr);
-	if (!vma) {
-		vmap_lock.unlock_dpc ();
+	if (!release_area ((uintptr_t) ptr, true))
 		printk (PR_ERROR "kfree_large() was called on a pointer which does not exist in the vmap_tree\n");
-		return;
-	}
-
-	free_pte_range_entire_vma (vma, true);
-	vmap_tree.remove (vma);
-	vmap_lock.unlock_dpc ();
-	kfree (vma);
 }
 
+/**
+ * get_entry - get the page table entry that maps an address at some level.
+ * @addr: the address
+ * @leaf: level of the entry; zero for a 4 KiB page, one for a 2 MiB page, etc.
+ * Returns NULL if a page table could not be allocated.
+ */
 static pte_t *
-get_pte (uintptr_t addr)
+get_entry (uintptr_t addr, int leaf)
 {
 	int level = max_pgtable_level ();
 	pte_t *entry = get_vmap_pgtable_entry (addr);
@@ -155,16 +340,99 @@ get_pte (uintptr_t addr)
 				free_pgtable (new_table, level);
 		}
 		entry = pgtable_entry (value, addr, level);
-	} while (level > 1);
+	} while (level > leaf + 1);
 	return entry;
 }
 
+/**
+ * The lowest-level page table that was used last, so that mapping consecutive
+ * pages only has to walk the page tables once for each 2 MiB.
+ */
+struct pte_walker {
+	pte_t *table = nullptr;
+	uintptr_t start = 0;
+};
+
+static pte_t *
+walk_pte (pte_walker *w, uintptr_t addr)
+{
+	if (!w->table || addr - w->start >= P1D_SIZE) {
+		pte_t *pte = get_entry (addr, 0);
+		if (!pte)
+			return nullptr;
+
+		w->table = pte - __pgtable_index (addr, 1);
+		w->start = dsl::align_down (addr, P1D_SIZE);
+	}
+
+	return w->table + __pgtable_index (addr, 1);
+}
+
+/**
+ * map_huge - map a huge page if there is no page table in the way.
+ * @addr: virtual address, aligned to the size of the page
+ * @phys: physical address, aligned to the size of the page
+ * @flags: the flags a 4 KiB entry would have
+ * @level: one for a 2 MiB page, two for a 1 GiB page
+ * Returns false if the entry is already in use or could not be allocated.
+ */
 static bool
-find_free_with_guard_pages (uintptr_t *out, size_t size, uintptr_t low, uintptr_t high)
+map_huge (uintptr_t addr, uintptr_t phys, pteval_t flags, int level)
+{
+	pte_t *entry = get_entry (addr, level);
+	if (!entry)
+		return false;
+
+	pte_t value = make_huge_pte_k (phys, flags);
+	return pgtable_install (entry, value);
+}
+
+/**
+ * huge_align - find the best alignment for a mapping of physical memory.
+ * @phys: physical address of the memory
+ * @size: size of the memory in bytes
+ * Returns the size of the largest huge page that fits within the range, or
+ * PAGE_SIZE if there is none.
+ */
+static size_t
+huge_align (uintptr_t phys, size_t size)
+{
+	for (int level = max_huge_level (); level; level--) {
+		size_t align = __pgtable_entry_size (level + 1);
+		uintptr_t first = dsl::align_up (phys, align);
+		if (first < phys || first - phys >= size)
+			continue;
+
+		if (size - (first - phys) >= align)
+			return align;
+	}
+
+	return PAGE_SIZE;
+}
+
+/**
+ * find_free_with_guard_pages - find address space with a guard page around it.
+ * @out: the address is stored here
+ * @size: size in bytes
+ * @low: lowest acceptable address
+ * @high: highest acceptable address
+ * @align: alignment of @out - @align_offset
+ * @align_offset: offset of @out from an @align boundary
+ * Returns false on failure.  This function must be called with vmap_lock held.
+ */
+static bool
+find_free_with_guard_pages (uintptr_t *out, size_t size, uintptr_t low, uintptr_t high,
+		size_t align, size_t align_offset)
 {
-	constexpr size_t left_guard_hole = PAGE_SIZE;
 	constexpr size_t right_guard_hole = PAGE_SIZE;
 
+	/*
+	 * The hole is aligned to @align, so the mapping starts @align_offset
+	 * into it, or @align into it if that would not leave a guard page.
+	 */
+	size_t left_guard_hole = align_offset ? align_offset
+			: dsl::max (align, (size_t) PAGE_SIZE);
+
 	size_t hole_size = size + left_guard_hole + right_guard_hole;
 	if (hole_size < size)
 		return false;
@@ -180,13 +448,135 @@ find_free_with_guard_pages (uintptr_t *out, size_t size, uintptr_t low, uintptr_
 		high = dsl::VMA_TREE_MAX;
 
 	uintptr_t addr = 0;
-	if (!vmap_tree.find_free_bottomup (&addr, hole_size, PAGE_SIZE, low, high))
-		return false;
+	if (!vmap_tree.find_free_bottomup (&addr, hole_size, align, low, high)) {
+		/* Try again after releasing the address space of lazy areas.  */
+		if (!lazy_nr_pages)
+			return false;
+
+		purge_lazy_areas ();
+		if (!vmap_tree.find_free_bottomup (&addr, hole_size, align, low, high))
+			return false;
+	}
 
 	*out = addr + left_guard_hole;
 	return true;
 }
 
+/**
+ * alloc_area - reserve a range of the kernel's address space.
+ * @size: size of the range in bytes
+ * @low: lowest acceptable address
+ * @high: highest acceptable address
+ * @block: whether the area is to be used as a vmap block
+ * @align: alignment of the address of the range minus @align_offset
+ * @align_offset: offset of the range from an @align boundary
+ * Returns the area, or NULL on failure.
+ */
+static vmap_area *
+alloc_area (size_t size, uintptr_t low, uintptr_t high, bool block,
+		size_t align, size_t align_offset)
+{
+	vmap_area *vma;
+	if (block) {
+		vmap_block *vb = (vmap_block *) kmalloc (sizeof (*vb),
+				ALLOC_KERNEL | __ALLOC_ZERO);
+		if (!vb)
+			return nullptr;
+
+		vb->lock.init ();
+		vma = &vb->area;
+	} else {
+		vma = (vmap_area *) kmalloc (sizeof (*vma), ALLOC_KERNEL);
+		if (!vma)
+			return nullptr;
+	}
+
+	vma->lazy = false;
+	vma->block = block;
+
+	uintptr_t addr = 0;
+	scoped_spinlock_dpc g (vmap_lock);
+	if (!find_free_with_guard_pages (&addr, size, low, high, align, align_offset)) {
+		kfree (vma);
+		return nullptr;
+	}
+
+	asm ("" : "+r"(addr));
+	vma->node.first = addr;
+	vma->node.last = addr + size - 1;
+	vmap_tree.insert (vma);
+	return vma;
+}
+
+/**
+ * block_alloc - carve a small mapping out of this CPU's vmap block.
+ * @nr_pages: size of the mapping in pages, at most vmap_block_max_pages
+ * Returns the address of the mapping, or zero on failure.
+ */
+static uintptr_t
+block_alloc (size_t nr_pages)
+{
+	scoped_dpc g;
+	vmap_block **current = percpu_ptr (current_vmap_block);
+	vmap_block *vb = *current;
+	if (vb) {
+		bool release;
+		{
+			scoped_spinlock_dpc g (vb->lock);
+			if (vb->next + nr_pages + 1 <= vmap_block_pages) {
+				size_t offset = vb->next;
+				vb->sizes[offset] = nr_pages;
+				vb->next += nr_pages + 1;
+				return vb->area.node.first + offset * PAGE_SIZE;
+			}
+
+			vb->retired = true;
+			release = vb->nr_freed == vb->next;
+		}
+
+		*current = nullptr;
+		if (release) {
+			scoped_spinlock_dpc g (vmap_lock);
+			lazy_free_area (&vb->area, false);
+		}
+	}
+
+	vmap_area *vma = alloc_area (vmap_block_pages * PAGE_SIZE,
+			KERNEL_VM_FIRST, KERNEL_VM_LAST, true, PAGE_SIZE, 0);
+	if (!vma)
+		return 0;
+
+	vb = container_of (&vmap_block::area, vma);
+	vb->sizes[0] = nr_pages;
+	vb->next = nr_pages + 1;
+	*current = vb;
+	return vma->node.first;
+}
+
+/**
+ * reserve_range - reserve address space for a mapping.
+ * @size: size of the mapping in bytes
+ * @low: lowest acceptable address
+ * @high: highest acceptable address
+ * @align: alignment of the address of the mapping minus @align_offset
+ * @align_offset: offset of the mapping from an @align boundary
+ * Returns the address of the mapping, or zero on failure.
+ */
+static uintptr_t
+reserve_range (size_t size, uintptr_t low, uintptr_t high,
+		size_t align, size_t align_offset)
+{
+	if (align == PAGE_SIZE && size <= vmap_block_max_pages * PAGE_SIZE
+			&& low <= KERNEL_VM_FIRST && high >= KERNEL_VM_LAST) {
+		uintptr_t addr = block_alloc (size / PAGE_SIZE);
+		if (addr)
+			return addr;
+	}
+
+	vmap_area *vma = alloc_area (size, low, high, false, align, align_offset);
+	return vma ? vma->node.first : 0;
+}
+
 /**
  * vmap_io_range - map memory-mapped IO into the kernel's address space.
  * @phys: physical address of MMIO window
@@ -208,40 +598,39 @@ vmap_io_range (uintptr_t phys, size_t size, page_cache_mode pcm, uintptr_t low,
 	if (!size)
 		return nullptr;
 
-	vmap_area *vma = (vmap_area *) kmalloc (sizeof (*vma), ALLOC_KERNEL);
-	if (!vma)
+	size_t align = huge_align (phys, size);
+	uintptr_t addr = reserve_range (size, low, high, align, phys & (align - 1));
+	if (!addr)
 		return nullptr;
 
-	uintptr_t addr = 0;
-
-	vmap_lock.lock_dpc ();
-	if (!find_free_with_guard_pages (&addr, size, low, high)) {
-		vmap_lock.unlock_dpc ();
-		kfree (vma);
-		return nullptr;
-	}
+	pteval_t flags = make_io_pteval (pcm);
+	pte_walker w;
+	for (uintptr_t i = 0; i < size; ) {
+		size_t left = size - i;
+		if (left >= P2D_SIZE && !(((addr + i) | (phys + i)) & (P2D_SIZE - 1))
+				&& max_huge_level () >= 2
+				&& map_huge (addr + i, phys + i, flags, 2)) {
+			i += P2D_SIZE;
+			continue;
+		}
 
-	asm ("" : "+r"(addr));
-	vma->node.first = addr;
-	vma->node.last = addr + size - 1;
-	vmap_tree.insert (vma);
-	vmap_lock.unlock_dpc ();
+		if (left >= P1D_SIZE && !(((addr + i) | (phys + i)) & (P1D_SIZE - 1))
+				&& map_huge (addr + i, phys + i, flags, 1)) {
+			i += P1D_SIZE;
+			continue;
+		}
 
-	for (uintptr_t i = 0; i < size; i += PAGE_SIZE) {
-		pte_t *pte = get_pte (addr + i);
+		pte_t *pte = walk_pte (&w, addr + i);
 		if (!pte) {
-			vmap_lock.lock_dpc ();
-			free_pte_range_vma (addr, addr + i, vma, false);
-			vmap_tree.remove (vma);
-			vmap_lock.unlock_dpc ();
-			kfree (vma);
+			release_area (addr, false);
 			return nullptr;
 		}
 
-		pte_install (pte, make_io_pte (phys + i, pcm));
+		pte_install (pte, make_pte_k (phys + i, flags));
+		i += PAGE_SIZE;
 	}
 
-	return (void *) (vma->node.first + offset_in_page);
+	return (void *) (addr + offset_in_page);
 }
 
 /**
@@ -295,49 +684,66 @@ kmalloc_large (size_t size)
 	if (!size)
 		return nullptr;
 
-	vmap_area *vma = (vmap_area *) kmalloc (sizeof (*vma), ALLOC_KERNEL);
-	if (!vma)
-		return nullptr;
+	/*
+	 * Take as much of the allocation as we can in 2 MiB blocks, which can
+	 * be mapped with huge pages, and the rest in single pages.
+	 */
+	constexpr unsigned int huge_order = 9;
+	PageList huge_pages;
+	size_t huge_size = 0;
+	while (size - huge_size >= P1D_SIZE) {
+		Page *page = alloc_pages (huge_order, ALLOC_KERNEL);
+		if (!page)
+			break;
+
+		huge_pages.push_back (page);
+		huge_size += P1D_SIZE;
+	}
 
-	uintptr_t addr = 0;
+	PageList pages;
+	if (size != huge_size && !alloc_pages_bulk (ALLOC_KERNEL,
+				(size - huge_size) / PAGE_SIZE, &pages)) {
+		while (!huge_pages.empty ())
+			free_pages (huge_pages.pop_front (), huge_order);
+		return nullptr;
+	}
 
-	vmap_lock.lock_dpc ();
-	if (!find_free_with_guard_pages (&addr, size, KERNEL_VM_FIRST, KERNEL_VM_LAST)) {
-		vmap_lock.unlock_dpc ();
-		kfree (vma);
+	uintptr_t addr = reserve_range (size, KERNEL_VM_FIRST, KERNEL_VM_LAST,
+			huge_size ? P1D_SIZE : PAGE_SIZE, 0);
+	if (!addr) {
+		while (!huge_pages.empty ())
+			free_pages (huge_pages.pop_front (), huge_order);
+		free_pages_bulk (&pages);
 		return nullptr;
 	}
 
-	asm ("" : "+r"(addr));
-	vma->node.first = addr;
-	vma->node.last = addr + size - 1;
-	vmap_tree.insert (vma);
-	vmap_lock.unlock_dpc ();
-
-	for (uintptr_t i = 0; i < size; i += PAGE_SIZE) {
-		Page *page = alloc_page (ALLOC_KERNEL);
-		if (!page) {
-			vmap_lock.lock_dpc ();
-			free_pte_range_vma (addr, addr + i, vma, true);
-			vmap_tree.remove (vma);
-			vmap_lock.unlock_dpc ();
-			kfree (vma);
-			return nullptr;
+	pte_walker w;
+	for (uintptr_t i = 0; i < size; ) {
+		if (i < huge_size && !(i & (P1D_SIZE - 1))) {
+			uintptr_t phys = page_to_phys (huge_pages.pop_front ());
+			if (map_huge (addr + i, phys, PAGE_KERNEL_DATA, 1)) {
+				i += P1D_SIZE;
+				continue;
+			}
+
+			/* A page table is in the way; map the block page by page.  */
+			for (uintptr_t j = 0; j < P1D_SIZE; j += PAGE_SIZE)
+				pages.push_front (phys_to_page (phys + P1D_SIZE - PAGE_SIZE - j));
 		}
 
-		pte_t *pte = get_pte (addr + i);
+		pte_t *pte = walk_pte (&w, addr + i);
 		if (!pte) {
-			free_page (page);
-			vmap_lock.lock_dpc ();
-			free_pte_range_vma (addr, addr + i, vma, true);
-			vmap_tree.remove (vma);
-			vmap_lock.unlock_dpc ();
-			kfree (vma);
+			while (!huge_pages.empty ())
+				free_pages (huge_pages.pop_front (), huge_order);
+			free_pages_bulk (&pages);
+			release_area (addr, true);
 			return nullptr;
 		}
 
+		Page *page = pages.pop_front ();
 		pte_install (pte, make_pte_k (page_to_phys (page), PAGE_KERNEL_DATA));
+		i += PAGE_SIZE;
 	}
 
-	return (void *) vma->node.first;
+	return (void *) addr;
 }